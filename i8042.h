@@ -1,4 +1,7 @@
 #include <linux/delay.h>
+#include <linux/hrtimer.h>
+#include <linux/spinlock.h>
+#include "keydance_trace.h"
 #include <linux/i8042.h>
 
 #define I8042_KBD_IRQ  1
@@ -30,36 +33,394 @@ static inline void i8042_write_command(int val)
         outb(val, I8042_COMMAND_REG);
 }
 
+#define I8042_LED_SCROLLLOCK 0x01
+#define I8042_LED_NUMLOCK    0x02
+#define I8042_LED_CAPSLOCK   0x04
+
+#define I8042_CMD_SETLEDS    0xed
+
 /*
- * i8042_led_blink() will turn the keyboard LEDs on or off
- * Note that DELAY has a limit of 10ms so we will not get stuck here
- * waiting for KBC to free up even if KBD interrupt is off
+ * Asynchronous LED engine
+ *
+ * i8042_led_post() records the wanted LED state and returns at once.
+ * The bytes are sent by a small state machine run from an hrtimer, which
+ * polls IBF every poll_ns (I8042_LED_POLL_NS until calibrated, see
+ * i8042_led_set_poll()) instead of spinning in mdelay().  Each byte is
+ * then answered by the keyboard with an ACK, or a RESEND.  With ack_irq
+ * set, the keyboard interrupt handler passes those to i8042_led_reply(),
+ * so the next byte goes out as soon as the ACK is in and a RESEND sends
+ * the byte again; a byte without an answer is taken as received after
+ * I8042_LED_TIMEOUT_NS.  Without ack_irq nobody sees the answers and the
+ * engine waits a fixed I8042_LED_GAP_NS after each byte instead.  Either
+ * way the waits are hrtimer expiries, so nothing here ever busy-waits and
+ * posting is cheap enough for timer, hard IRQ and IRQ thread context.
  *
- * @state: the control value for all 3 leds. 
- *         i8042_led_blink(I8042_LED_NUMLOCK | I8042_LED_CAPSLOCK) would
+ * Writes are coalesced: posts only update a single desired mask, and a
+ * 0xED/state pair is sent only when that mask differs from the last one
+ * the keyboard took.  A burst of posts during one round-trip therefore
+ * costs at most one more write, carrying the latest state.
+ *
+ * With sim set there is no controller: a write "completes" as soon as it
+ * is loaded and the state is only stored in sink.
+ *
+ * Like the old DELAY limit, IBF is polled for at most I8042_LED_TIMEOUT_NS
+ * before the byte is written anyway, so a stuck KBC can not stall the
+ * engine.
+ *
+ * While calibrate is set, the engine also times how long each byte waits
+ * for IBF to clear, how long the keyboard takes to ACK it (reported by
+ * the interrupt handler) and whole writes.
+ */
+#define I8042_LED_POLL_NS    (100 * NSEC_PER_USEC)
+#define I8042_LED_POLL_MIN_NS (10 * NSEC_PER_USEC)
+#define I8042_LED_GAP_NS     NSEC_PER_MSEC
+#define I8042_LED_TIMEOUT_NS (10 * NSEC_PER_MSEC)
+#define I8042_LED_RETRIES    3
+
+#define I8042_KBD_ACK        0xfa
+#define I8042_KBD_RESEND     0xfe
+
+/* min/avg/max of a measured time */
+struct i8042_led_time {
+        u64 min_ns;
+        u64 max_ns;
+        u64 total_ns;
+        unsigned long count;
+};
+
+static inline void i8042_led_time_add(struct i8042_led_time *t, u64 ns)
+{
+        if (!t->count || ns < t->min_ns)
+                t->min_ns = ns;
+        if (ns > t->max_ns)
+                t->max_ns = ns;
+        t->total_ns += ns;
+        t->count++;
+}
+
+static inline u64 i8042_led_time_avg(const struct i8042_led_time *t)
+{
+        return t->count ? div_u64(t->total_ns, t->count) : 0;
+}
+
+enum i8042_led_phase {
+        I8042_LED_IDLE,         /* nothing in flight */
+        I8042_LED_SEND_CMD,     /* waiting for IBF to clear, then 0xed */
+        I8042_LED_ACK_CMD,      /* waiting for the keyboard to ACK it */
+        I8042_LED_SEND_STATE,   /* waiting for IBF to clear, then state */
+        I8042_LED_ACK_STATE,    /* waiting for the keyboard to ACK it */
+        I8042_LED_SETTLE,       /* the keyboard took the state */
+};
+
+static struct i8042_led_engine {
+        spinlock_t lock;
+        struct hrtimer timer;
+        enum i8042_led_phase phase;
+        int desired;                    /* latest posted state */
+        int acked;                      /* last state sent, -1 if unknown */
+        char state;                     /* state byte in flight */
+        int polls;                      /* IBF polls for current byte */
+        int busy;                       /* IBF busy polls for this write */
+        u64 poll_ns;                    /* IBF poll interval */
+        int max_polls;                  /* ... polls before writing anyway */
+        u64 wait_ns;                    /* current byte started polling */
+        u64 sent_ns;                    /* current byte written */
+        u64 deadline_ns;                /* ... and taken as received */
+        int retries;                    /* RESENDs of the current byte */
+        bool ack_irq;                   /* i8042_led_reply() gets answers */
+        unsigned long resends;          /* bytes sent again on RESEND */
+        unsigned long timeouts;         /* bytes never answered */
+        unsigned long failures;         /* writes dropped after retries */
+        unsigned long posts;            /* i8042_led_post() calls */
+        unsigned long writes;           /* 0xED/state pairs sent */
+        u64 pending_ns;                 /* first post not yet sent, or 0 */
+        u64 start_ns;                   /* first post of the write in flight */
+        /* optional, called with lock held once a state has been sent,
+           with the time since it was first posted. Must not post. */
+        void (*done)(char state, u64 latency_ns);
+        bool sim;                       /* no hardware, write to sink */
+        u32 sink;                       /* LEDs as the sim shows them */
+        bool calibrate;                 /* collect the times below */
+        struct i8042_led_time ibf;      /* IBF clear, per byte */
+        struct i8042_led_time ack;      /* byte written to its ACK */
+        struct i8042_led_time rtt;      /* first post to state settled */
+} i8042_led;
+
+/* true while the current byte has to wait for IBF; once it may be sent,
+   the wait is timed and the byte is taken as written */
+static inline bool i8042_led_ibf_busy(struct i8042_led_engine *e)
+{
+        u64 now = ktime_get_ns();
+
+        if (!e->polls++)
+                e->wait_ns = now;
+        if (i8042_read_status() & I8042_STR_IBF) {
+                e->busy++;
+                if (e->polls < e->max_polls)
+                        return true;
+        }
+        if (e->calibrate)
+                i8042_led_time_add(&e->ibf, now - e->wait_ns);
+        e->sent_ns = now;
+        return false;
+}
+
+/* start sending the desired state; caller holds e->lock */
+static inline void i8042_led_load(struct i8042_led_engine *e)
+{
+        e->state = e->desired;
+        e->start_ns = e->pending_ns;
+        e->pending_ns = 0;
+        e->writes++;
+        e->phase = I8042_LED_SEND_CMD;
+        e->polls = 0;
+        e->busy = 0;
+        e->retries = 0;
+        trace_keydance_led_write_start(e->state);
+}
+
+/* a byte went out: wait for its answer, or the fixed gap without one */
+static inline u64 i8042_led_sent(struct i8042_led_engine *e,
+                                 enum i8042_led_phase phase)
+{
+        u64 wait = e->ack_irq ? I8042_LED_TIMEOUT_NS : I8042_LED_GAP_NS;
+
+        e->phase = phase;
+        e->deadline_ns = e->sent_ns + wait;
+        return wait;
+}
+
+/* the timer ran while waiting for an answer: the time left, or 0 once the
+   byte is taken as received */
+static inline u64 i8042_led_ack_left(struct i8042_led_engine *e)
+{
+        u64 now = ktime_get_ns();
+
+        if (now < e->deadline_ns)
+                return e->deadline_ns - now;
+        if (e->ack_irq)
+                e->timeouts++;
+        return 0;
+}
+
+/* caller holds e->lock; returns the delay before the next step, 0 if idle */
+static u64 i8042_led_step(struct i8042_led_engine *e)
+{
+        u64 latency, left;
+
+        switch (e->phase) {
+        case I8042_LED_IDLE:
+                return 0;
+        case I8042_LED_SEND_CMD:
+                if (i8042_led_ibf_busy(e))
+                        return e->poll_ns;
+                i8042_write_data(I8042_CMD_SETLEDS);
+                return i8042_led_sent(e, I8042_LED_ACK_CMD);
+        case I8042_LED_ACK_CMD:
+                left = i8042_led_ack_left(e);
+                if (left)
+                        return left;
+                e->phase = I8042_LED_SEND_STATE;
+                e->polls = 0;
+                e->retries = 0;
+                /* fall through */
+        case I8042_LED_SEND_STATE:
+                if (i8042_led_ibf_busy(e))
+                        return e->poll_ns;
+                i8042_write_data(e->state);
+                return i8042_led_sent(e, I8042_LED_ACK_STATE);
+        case I8042_LED_ACK_STATE:
+                left = i8042_led_ack_left(e);
+                if (left)
+                        return left;
+                /* fall through */
+        case I8042_LED_SETTLE:
+                e->acked = e->state;
+                latency = ktime_get_ns() - e->start_ns;
+                if (e->calibrate)
+                        i8042_led_time_add(&e->rtt, latency);
+                trace_keydance_led_write_finish(e->state, e->busy, latency);
+                if (e->done)
+                        e->done(e->state, latency);
+                break;
+        }
+
+        if (e->desired == e->acked) {
+                e->phase = I8042_LED_IDLE;
+                e->pending_ns = 0;
+                return 0;
+        }
+        i8042_led_load(e);
+        return e->poll_ns;
+}
+
+static enum hrtimer_restart i8042_led_timerfn(struct hrtimer *timer)
+{
+        struct i8042_led_engine *e = container_of(timer,
+                                        struct i8042_led_engine, timer);
+        unsigned long flags;
+        u64 next;
+
+        /* re-armed under the lock, as i8042_led_reply() may re-arm it
+           from the interrupt at any time */
+        spin_lock_irqsave(&e->lock, flags);
+        next = i8042_led_step(e);
+        if (next)
+                hrtimer_start(timer, ns_to_ktime(next), HRTIMER_MODE_REL);
+        spin_unlock_irqrestore(&e->lock, flags);
+        return HRTIMER_NORESTART;
+}
+
+/*
+ * i8042_led_post() will turn the keyboard LEDs on or off, asynchronously
+ *
+ * @state: the control value for all 3 leds.
+ *         i8042_led_post(I8042_LED_NUMLOCK | I8042_LED_CAPSLOCK) would
  *         turn on numlock and capslock.
+ *
+ * Only the last state posted before the engine gets to it is written,
+ * and nothing is written if it matches what the keyboard already shows.
+ * __i8042_led_post() is the same with i8042_led.lock already held.
  */
+static void __i8042_led_post(char state)
+{
+        struct i8042_led_engine *e = &i8042_led;
 
-#define DELAY do { mdelay(1); if (++delay > 10) return delay; } while(0)
+        e->posts++;
+        e->desired = (unsigned char)state;
+        if (!e->pending_ns)
+                e->pending_ns = ktime_get_ns();
+        if (e->phase != I8042_LED_IDLE)
+                return;
+        if (e->desired == e->acked) {
+                e->pending_ns = 0;
+                return;
+        }
+        i8042_led_load(e);
+        if (e->sim) {
+                e->sink = (unsigned char)e->state;
+                e->phase = I8042_LED_SETTLE;
+                i8042_led_step(e);
+                return;
+        }
+        hrtimer_start(&e->timer, ns_to_ktime(0), HRTIMER_MODE_REL);
+}
 
-#define I8042_LED_SCROLLLOCK 0x01
-#define I8042_LED_NUMLOCK    0x02
-#define I8042_LED_CAPSLOCK   0x04
+static void i8042_led_post(char state)
+{
+        unsigned long flags;
+
+        spin_lock_irqsave(&i8042_led.lock, flags);
+        __i8042_led_post(state);
+        spin_unlock_irqrestore(&i8042_led.lock, flags);
+}
 
+static inline bool i8042_led_idle(void)
+{
+        return READ_ONCE(i8042_led.phase) == I8042_LED_IDLE;
+}
+
+/*
+ * i8042_led_blink() is the synchronous form for process context: post
+ * @state and sleep until the engine has sent it, giving up after 20ms.
+ * The LEDs may have been changed behind our back by atkbd, so this always
+ * writes @state even if it matches the last acknowledged one.
+ * Returns the number of milliseconds waited.
+ */
 static long i8042_led_blink(char state)
 {
         long delay = 0;
+        unsigned long flags;
 
-        while (i8042_read_status() & I8042_STR_IBF)
-                DELAY;
-        pr_debug("%02x -> i8042 (blink)\n", 0xed);
-        i8042_write_data(0xed); /* set leds */
-        DELAY;
-        while (i8042_read_status() & I8042_STR_IBF)
-                DELAY;
-        DELAY;
-        pr_debug("%02x -> i8042 (blink)\n", state);
-        i8042_write_data(state);
-        DELAY;
+        spin_lock_irqsave(&i8042_led.lock, flags);
+        i8042_led.acked = -1;
+        spin_unlock_irqrestore(&i8042_led.lock, flags);
+        i8042_led_post(state);
+        while (!i8042_led_idle() && delay < 20) {
+                usleep_range(1000, 1500);
+                delay++;
+        }
         return delay;
 }
+
+/*
+ * i8042_led_reply() takes a byte from the keyboard interrupt handler.  An
+ * ACK or RESEND answering a byte the engine is waiting on is consumed: an
+ * ACK sends the next byte at once, a RESEND sends the same byte again up
+ * to I8042_LED_RETRIES times, then the write is dropped as failed and the
+ * LED state is taken as unknown.  Returns true if @byte was consumed.
+ */
+static bool i8042_led_reply(unsigned char byte)
+{
+        struct i8042_led_engine *e = &i8042_led;
+        unsigned long flags;
+        bool cmd, ours;
+
+        if (byte != I8042_KBD_ACK && byte != I8042_KBD_RESEND)
+                return false;
+        spin_lock_irqsave(&e->lock, flags);
+        cmd = e->phase == I8042_LED_ACK_CMD;
+        ours = e->ack_irq && (cmd || e->phase == I8042_LED_ACK_STATE);
+        if (!ours)
+                goto out;
+        e->polls = 0;
+        if (byte == I8042_KBD_ACK) {
+                if (e->calibrate)
+                        i8042_led_time_add(&e->ack,
+                                           ktime_get_ns() - e->sent_ns);
+                e->retries = 0;
+                e->phase = cmd ? I8042_LED_SEND_STATE : I8042_LED_SETTLE;
+        } else if (e->retries++ < I8042_LED_RETRIES) {
+                e->resends++;
+                e->phase = cmd ? I8042_LED_SEND_CMD : I8042_LED_SEND_STATE;
+        } else {
+                e->failures++;
+                e->acked = -1;
+                e->phase = I8042_LED_IDLE;
+                if (!e->pending_ns)
+                        goto out;
+                i8042_led_load(e);      /* a newer state is waiting */
+        }
+        hrtimer_start(&e->timer, ns_to_ktime(0), HRTIMER_MODE_REL);
+out:
+        spin_unlock_irqrestore(&e->lock, flags);
+        return ours;
+}
+
+/* Whether the keyboard interrupt handler passes answers on */
+static void i8042_led_set_ack_irq(bool on)
+{
+        unsigned long flags;
+
+        spin_lock_irqsave(&i8042_led.lock, flags);
+        i8042_led.ack_irq = on;
+        spin_unlock_irqrestore(&i8042_led.lock, flags);
+}
+
+/* Poll IBF every @poll_ns, still giving up after I8042_LED_TIMEOUT_NS */
+static void i8042_led_set_poll(u64 poll_ns)
+{
+        unsigned long flags;
+
+        poll_ns = clamp_t(u64, poll_ns, I8042_LED_POLL_MIN_NS,
+                          I8042_LED_POLL_NS);
+        spin_lock_irqsave(&i8042_led.lock, flags);
+        i8042_led.poll_ns = poll_ns;
+        i8042_led.max_polls = div64_u64(I8042_LED_TIMEOUT_NS + poll_ns - 1,
+                                        poll_ns);
+        spin_unlock_irqrestore(&i8042_led.lock, flags);
+}
+
+static void i8042_led_init(void)
+{
+        spin_lock_init(&i8042_led.lock);
+        i8042_led.acked = -1;
+        i8042_led_set_poll(I8042_LED_POLL_NS);
+        hrtimer_init(&i8042_led.timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+        i8042_led.timer.function = i8042_led_timerfn;
+}
+
+static void i8042_led_exit(void)
+{
+        hrtimer_cancel(&i8042_led.timer);
+}
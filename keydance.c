@@ -14,196 +14,3290 @@
  * Scrolllock LED: number key 3
  *
  * There are two /proc files for starting games and displaying results:
- * /proc/keydance-start: start by writing any chars to it
+ * /proc/keydance-start: control commands, "1" or "start" starts a game
  * /proc/keydance-result: game statistics (hits, misses, current level)
  *
  * As a kernel programming homework, it cover topics of:
- * kernel module, dynamic timer, IRQ handler, IRQ thread, spin_lock, 
+ * kernel module, dynamic timer, IRQ handler, IRQ thread, atomic cmpxchg,
  * IO port access, procfs, seq_file and etc.
  */
 
 #include <linux/module.h>		/* for module_init() */
-#include <linux/seq_file.h>		/* for single_open() */
 #include <linux/proc_fs.h>		/* for proc_create() */
-#include <linux/random.h>		/* for get_random_bytes() */
+#include <linux/random.h>		/* for prandom_u32_state() */
 #include <linux/interrupt.h>		/* for request_irq() */
+#include <linux/hrtimer.h>		/* for hrtimer_start() */
+#include <linux/atomic.h>		/* for atomic64_cmpxchg() */
+#include <linux/mutex.h>		/* for DEFINE_MUTEX() */
+#include <linux/kfifo.h>		/* for DECLARE_KFIFO() */
+#include <linux/miscdevice.h>		/* for misc_register() */
+#include <linux/mm.h>			/* for vm_insert_page() */
+#include <linux/poll.h>			/* for poll_wait() */
+#include <linux/workqueue.h>		/* for schedule_delayed_work() */
+#include <linux/percpu.h>		/* for DEFINE_PER_CPU() */
+#include <linux/debugfs.h>		/* for debugfs_create_file() */
+#include <linux/vmalloc.h>		/* for vmalloc() */
+#include <linux/sort.h>			/* for sort() */
+#include <linux/timex.h>		/* for get_cycles() */
+#include <linux/input.h>		/* for input_register_handler() */
+#include <linux/kthread.h>		/* for kthread_create() */
+#include <linux/sched.h>		/* for sched_setscheduler() */
+#include <linux/capability.h>		/* for capable() */
+#define CREATE_TRACE_POINTS
+#include "keydance_trace.h"		/* for trace_keydance_*() */
+#undef CREATE_TRACE_POINTS
 #include "i8042.h"			/* for LED control */
+#include "keydance.h"			/* for the binary interfaces */
 
 /* filename for /proc interface */
 static const char *keydance_start_fname = "keydance-start";
 static const char *keydance_result_fname = "keydance-result";
 
-static struct timer_list keydance_timer;
+/* Pattern stepping timer. The jiffy based timer_list is the default;
+ * use_hrtimer=1 selects an hrtimer instead, which is not rounded to HZ.
+ * Either way expiries are absolute: a session's expires advances by one
+ * step time per pattern, so re-arming late does not accumulate drift. */
+static bool use_hrtimer;
+module_param(use_hrtimer, bool, S_IRUGO);
+MODULE_PARM_DESC(use_hrtimer, "Step patterns with an hrtimer instead of a jiffy timer");
 
-/* Tracking the states of all LEDs 
- * bit 0: scrolllock, key
- * bit 1: numlock, 
- * bit 2: capslock */
-static unsigned char lock_state;
+/* Simulation mode: no keyboard is touched. LED writes only go to memory
+ * and scancodes are injected through debugfs, see keydance.h. With
+ * sim=2 the step timer is never armed and patterns only step on injected
+ * ticks, so games run as fast as the injector can write. */
+#define KEYDANCE_SIM_MANUAL 2
+static int sim;
+module_param(sim, int, S_IRUGO);
+MODULE_PARM_DESC(sim, "Simulate the keyboard: 1 = in memory, 2 = also step on injected ticks only");
 
-/* Protect i8042 LED operations, lock_state, timer.
-   Source of concurrency: timer, interrupt, irq thread, proc write process */
-static spinlock_t keydance_lock;
+/* Key bindings: make code of the key, its input layer keycode and the LED
+ * it answers. Several keys may share one LED. This is the only place the
+ * mapping is written down; the lookup tables below are generated from it
+ * at compile time. */
+#define KEYDANCE_KEYMAP(key)						\
+	key(0x02, KEY_1, I8042_LED_NUMLOCK)				\
+	key(0x03, KEY_2, I8042_LED_CAPSLOCK)				\
+	key(0x04, KEY_3, I8042_LED_SCROLLLOCK)
 
-/* 4, 2, 3 are the scancodes for key 1, key 2, key 3 respectively */
-static const char dancekey_scancode_table[3] = { 4, 2, 3 };
+/* Scancode to LED bit, direct indexed. Break codes (0x80 and up) and keys
+ * that are not bound map to 0, so a lookup is a single load. */
+#define KEYDANCE_KEY_ENTRY(scancode, keycode, led)	[scancode] = led,
+static const unsigned char dancekey_led_table[256] = {
+	KEYDANCE_KEYMAP(KEYDANCE_KEY_ENTRY)
+};
+
+/* The same for keycodes delivered by the input backend. */
+#define KEYDANCE_KEYCODE_ENTRY(scancode, keycode, led)	[keycode] = led,
+static const unsigned char dancekey_keycode_table[256] = {
+	KEYDANCE_KEYMAP(KEYDANCE_KEYCODE_ENTRY)
+};
+
+#define KEYDANCE_KEY_CHECK(scancode, keycode, led)			\
+	BUILD_BUG_ON((scancode) & 0x80);				\
+	BUILD_BUG_ON((keycode) > 0xff);					\
+	BUILD_BUG_ON(hweight8(led) != 1);
+
+/* Game state, packed into one 64-bit word so that every path (timer,
+ * interrupt, irq thread, proc) updates it with cmpxchg and never spins
+ * against another, and readers always see a consistent snapshot:
+ * bits  0-7 : lock_state, tracking the states of all LEDs
+ *             bit 0: scrolllock, bit 1: numlock, bit 2: capslock
+ * bits  8-15: extras, wrong keys pressed (saturating). Indicates a miss
+ * bits 16-31: hits, total patterns players reacts correctly
+ * bits 32-47: misses, total patterns players reacts wrong
+ * bits 48-55: level, control pattern changing speed
+ * bit  56   : running, two modes: running and stop mode
+ * bit  57   : paused, a running game whose step timer is stopped and
+ *             whose keys are dropped, see keydance_session_pause()
+ * Each session below has one.
+ */
+
+struct keydance_snap {
+	unsigned char lock_state;
+	unsigned char extras;
+	unsigned int hits;
+	unsigned int misses;
+	unsigned int level;
+	bool running;
+	bool paused;
+};
+
+#define KEYDANCE_PATTERNS 64	/* upcoming patterns per session, power of 2 */
+
+static inline void keydance_unpack(u64 v, struct keydance_snap *s)
+{
+	s->lock_state = v & 0xff;
+	s->extras = (v >> 8) & 0xff;
+	s->hits = (v >> 16) & 0xffff;
+	s->misses = (v >> 32) & 0xffff;
+	s->level = (v >> 48) & 0xff;
+	s->running = (v >> 56) & 1;
+	s->paused = (v >> 57) & 1;
+}
+
+static inline u64 keydance_pack(const struct keydance_snap *s)
+{
+	return (u64)s->lock_state | (u64)s->extras << 8 |
+	       (u64)(s->hits & 0xffff) << 16 |
+	       (u64)(s->misses & 0xffff) << 32 |
+	       (u64)(s->level & 0xff) << 48 | (u64)s->running << 56 |
+	       (u64)s->paused << 57;
+}
+
+/* Dance key presses and their hard IRQ time, passed from the hard IRQ
+ * handler (or the input backend's event handler) to the thread. @code is
+ * the backend's scancode or keycode, kept for tracing. */
+struct keydance_key {
+	u64 time_ns;
+	unsigned char code;
+	unsigned char bit;
+};
+
+/* One game. The i8042 and sim backends play a single session,
+ * keydance_main. The input backend gives every keyboard a session of its
+ * own, so several players can play at once. Sessions share no locks on
+ * the game paths, and the counters and histograms are per CPU, but every
+ * step still writes lines all sessions share: the heads of the event
+ * ring and the game log, the stats page (its writer never spins, see
+ * keydance_stats_publish()) and, with adaptive=, the adaptive work item.
+ */
+struct keydance_session {
+	atomic64_t state;		/* packed game state, see above */
+	u64 pattern_ns;			/* when the pattern was posted */
+	ktime_t expires;		/* of the step timer */
+	u64 remaining_ns;		/* of the step, while paused */
+	u64 paused_ns;			/* when the game was paused */
+	/* Game log, written by the step timer or with it stopped */
+	u64 log_ns;			/* time of the last record */
+	unsigned char log_pattern;	/* pattern of the current step */
+	struct timer_list timer;
+	struct hrtimer hrtimer;
+	/* With step_thread=1 the timer only kicks this thread to step */
+	struct task_struct *step_task;
+	struct mutex step_mutex;	/* held while it steps */
+	unsigned long step_kick;	/* bit 0: a step is due */
+	/* Upcoming patterns, see keydance_next_pattern() */
+	unsigned char patterns[KEYDANCE_PATTERNS];
+	unsigned int pattern_head;	/* next to show */
+	unsigned int pattern_tail;	/* next to fill, under pattern_lock */
+	spinlock_t pattern_lock;
+	struct rnd_state rnd;
+	struct work_struct pattern_work;
+	/* Keys for the thread. Single consumer; producers are a single
+	 * interrupt or injector, or take key_lock. */
+	DECLARE_KFIFO(keys, struct keydance_key, 16);
+	spinlock_t key_lock;
+	struct work_struct key_work;	/* consumer with the input backend */
+	/* LED state for backends that keep it per session (input) */
+	spinlock_t led_lock;		/* orders LED updates */
+	unsigned char led_state;	/* last LED state shown */
+	u64 led_posts, led_writes;
+	struct input_handle *handle;	/* keyboard, NULL if none */
+	const char *name;
+	u16 id;				/* slot in keydance_sessions[] */
+} ____cacheline_aligned_in_smp;
+
+/* Sessions by id. Written under keydance_ctl_mutex, read under it or RCU;
+ * slots are reused once their keyboard goes away. */
+#define KEYDANCE_MAX_SESSIONS 32
+static struct keydance_session __rcu *keydance_sessions[KEYDANCE_MAX_SESSIONS];
+static struct keydance_session keydance_main;
+
+#define keydance_for_each_session(i, ks)				\
+	for (i = 0; i < KEYDANCE_MAX_SESSIONS; i++)			\
+		if (((ks) = rcu_dereference_check(keydance_sessions[i],	\
+				lockdep_is_held(&keydance_ctl_mutex))))
+
+static inline void keydance_snapshot(struct keydance_session *ks,
+				     struct keydance_snap *s)
+{
+	keydance_unpack(atomic64_read(&ks->state), s);
+}
+
+/* Event counters since module load. Each CPU counts into its own copy, so
+ * the hot paths never write a shared cache line; the copies are only
+ * summed when the stats are read.
+ */
+struct keydance_counters {
+	unsigned long interrupts;	/* keyboard interrupts seen */
+	unsigned long filtered;		/* ... dropped by the hard handler */
+	unsigned long keys;		/* matching dance keys */
+	unsigned long wrong_keys;	/* dance keys whose LED was off */
+	unsigned long hits;		/* patterns answered */
+	unsigned long misses;		/* patterns missed */
+	unsigned long patterns;		/* patterns shown */
+	unsigned long games;		/* games started */
+};
+
+static DEFINE_PER_CPU(struct keydance_counters, keydance_counters);
+
+#define keydance_count(field)	this_cpu_inc(keydance_counters.field)
+
+static void keydance_counters_sum(struct keydance_counters *sum)
+{
+	const struct keydance_counters *c;
+	int cpu;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		c = &per_cpu(keydance_counters, cpu);
+		sum->interrupts += c->interrupts;
+		sum->filtered += c->filtered;
+		sum->keys += c->keys;
+		sum->wrong_keys += c->wrong_keys;
+		sum->hits += c->hits;
+		sum->misses += c->misses;
+		sum->patterns += c->patterns;
+		sum->games += c->games;
+	}
+}
+
+/* Latency histograms, log-linear in microseconds: values below
+ * KEYDANCE_HIST_SUB get one bucket each, above that every power of two is
+ * split into KEYDANCE_HIST_SUB buckets (12.5% resolution) up to 2^24 us.
+ * Per CPU like the counters; allocated at load time, since together they
+ * are too big for static per-CPU data.
+ */
+#define KEYDANCE_HIST_SUB_BITS	3
+#define KEYDANCE_HIST_SUB	(1 << KEYDANCE_HIST_SUB_BITS)
+#define KEYDANCE_HIST_BUCKETS	(22 * KEYDANCE_HIST_SUB)
+
+#define KEYDANCE_NKEYS 3    /* one reaction histogram per LED */
+#define KEYDANCE_HIST_KEY(i)	(i)
+#define KEYDANCE_HIST_LEVEL(l)	(KEYDANCE_NKEYS + (l))
+#define KEYDANCE_HIST_LEVELS	16  /* levels with a histogram of their own */
+#define KEYDANCE_HIST_LED	KEYDANCE_HIST_LEVEL(KEYDANCE_HIST_LEVELS)
+#define KEYDANCE_NHISTS		(KEYDANCE_HIST_LED + 1)
+
+struct keydance_hist {
+	u32 count[KEYDANCE_HIST_BUCKETS];
+	u64 max_ns;
+};
+
+static struct keydance_hist __percpu *keydance_hists;
+
+static const char * const keydance_led_names[KEYDANCE_NKEYS] = {
+	"scrolllock", "numlock", "capslock"
+};
+
+static unsigned int keydance_hist_bucket(u64 ns)
+{
+	u64 us = div_u64(ns, NSEC_PER_USEC);
+	unsigned int shift;
+
+	if (us < KEYDANCE_HIST_SUB)
+		return us;
+	shift = fls64(us) - 1 - KEYDANCE_HIST_SUB_BITS;
+	return min_t(u64, (shift + 1) * KEYDANCE_HIST_SUB +
+			  (us >> shift) - KEYDANCE_HIST_SUB,
+		     KEYDANCE_HIST_BUCKETS - 1);
+}
+
+/* lowest value in us that falls above bucket @b */
+static u64 keydance_hist_limit(unsigned int b)
+{
+	b++;
+	if (b < KEYDANCE_HIST_SUB)
+		return b;
+	return (u64)(KEYDANCE_HIST_SUB + b % KEYDANCE_HIST_SUB) <<
+	       (b / KEYDANCE_HIST_SUB - 1);
+}
+
+/* this_cpu ops keep this safe against interrupts on the same CPU */
+static void keydance_hist_add(int hist, u64 ns)
+{
+	this_cpu_inc(keydance_hists[hist].count[keydance_hist_bucket(ns)]);
+	if (ns > this_cpu_read(keydance_hists[hist].max_ns))
+		this_cpu_write(keydance_hists[hist].max_ns, ns);
+}
+
+/* Sum histogram @hist over all CPUs, returns the number of samples */
+static u64 keydance_hist_sum(int hist, struct keydance_hist *sum)
+{
+	const struct keydance_hist *h;
+	u64 total = 0;
+	int cpu, b;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		h = per_cpu_ptr(&keydance_hists[hist], cpu);
+		for (b = 0; b < KEYDANCE_HIST_BUCKETS; b++) {
+			sum->count[b] += h->count[b];
+			total += h->count[b];
+		}
+		sum->max_ns = max(sum->max_ns, h->max_ns);
+	}
+	return total;
+}
+
+/* @pct percentile of a summed histogram, in us */
+static u64 keydance_hist_pct(const struct keydance_hist *h, u64 total,
+			     unsigned int pct)
+{
+	u64 want = div_u64(total * pct + 99, 100), seen = 0;
+	u64 max_us = div_u64(h->max_ns, NSEC_PER_USEC);
+	int b;
+
+	for (b = 0; b < KEYDANCE_HIST_BUCKETS; b++) {
+		seen += h->count[b];
+		if (seen >= want)
+			return min(keydance_hist_limit(b) - 1, max_us);
+	}
+	return max_us;
+}
+
+/* Adaptive stepping, adaptive=N: once players have answered patterns,
+ * every level steps at N% of the p90 reaction time over all dance keys,
+ * scaled to aim at KEYDANCE_ADAPTIVE_HIT_PCT hits, instead of at the
+ * curve's step time, so games stay at the limit of the players and the
+ * input pipeline rather than at easy levels. Reactions slower than the
+ * step never make it into the histograms, so the p90 alone would only
+ * ever shrink the step: every miss lengthens it by as much as nine hits
+ * shorten it. The curve still decides levels and game over, and its
+ * first step is the slowest allowed; the fastest is the LED floor below,
+ * and never under KEYDANCE_STEP_FLOOR_NS. The work item below does the
+ * sums after every step, not the step timer.
+ */
+static unsigned int adaptive;
+module_param(adaptive, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(adaptive, "Step at this % of the p90 reaction time, 0 = follow the curve (default)");
+
+#define KEYDANCE_STEP_FLOOR_NS	(2 * I8042_LED_GAP_NS)	/* one LED write */
+
+/* Shortest step in any mode, the LED round-trip measured by the backend,
+ * so a pattern is never replaced before it could be shown. 0 if unknown.
+ */
+static u64 keydance_step_floor_ns;
+static u64 keydance_adaptive_ns;	/* the adaptive step, 0 if none */
+
+#define KEYDANCE_ADAPTIVE_HIT_PCT	90
+#define KEYDANCE_ADAPTIVE_ONE		1024	/* scale of 1 */
+#define KEYDANCE_ADAPTIVE_GAIN		128	/* 1/gain per hit */
+
+/* only used by the work below, which never runs twice at once */
+static struct keydance_hist keydance_adaptive_sum, keydance_adaptive_key;
+static u64 keydance_adaptive_scale = KEYDANCE_ADAPTIVE_ONE;
+static unsigned long keydance_adaptive_hits, keydance_adaptive_misses;
+
+/* Scale the step by the hits and misses since the last run */
+static void keydance_adaptive_feedback(void)
+{
+	struct keydance_counters c;
+	s64 hits, misses, delta;
+
+	keydance_counters_sum(&c);
+	if (c.hits < keydance_adaptive_hits ||
+	    c.misses < keydance_adaptive_misses) {
+		/* the stats were reset: start over */
+		keydance_adaptive_hits = keydance_adaptive_misses = 0;
+		keydance_adaptive_scale = KEYDANCE_ADAPTIVE_ONE;
+	}
+	hits = c.hits - keydance_adaptive_hits;
+	misses = c.misses - keydance_adaptive_misses;
+	keydance_adaptive_hits = c.hits;
+	keydance_adaptive_misses = c.misses;
+	delta = misses * KEYDANCE_ADAPTIVE_HIT_PCT /
+		(100 - KEYDANCE_ADAPTIVE_HIT_PCT) - hits;
+	delta = clamp_t(s64, delta, -KEYDANCE_ADAPTIVE_GAIN / 2,
+			KEYDANCE_ADAPTIVE_GAIN);
+	keydance_adaptive_scale += div_s64((s64)keydance_adaptive_scale * delta,
+					   KEYDANCE_ADAPTIVE_GAIN);
+	keydance_adaptive_scale = clamp_t(u64, keydance_adaptive_scale,
+					  KEYDANCE_ADAPTIVE_ONE / 8,
+					  KEYDANCE_ADAPTIVE_ONE * 8);
+}
+
+static void keydance_adaptive_fn(struct work_struct *work)
+{
+	struct keydance_hist *sum = &keydance_adaptive_sum;
+	struct keydance_hist *h = &keydance_adaptive_key;
+	u64 total = 0, p90_us, step_ns;
+	int i, b;
+
+	keydance_adaptive_feedback();
+
+	memset(sum, 0, sizeof(*sum));
+	for (i = 0; i < KEYDANCE_NKEYS; i++) {
+		total += keydance_hist_sum(KEYDANCE_HIST_KEY(i), h);
+		for (b = 0; b < KEYDANCE_HIST_BUCKETS; b++)
+			sum->count[b] += h->count[b];
+		sum->max_ns = max(sum->max_ns, h->max_ns);
+	}
+	p90_us = total ? keydance_hist_pct(sum, total, 90) : 0;
+	step_ns = div_u64(p90_us * NSEC_PER_USEC * READ_ONCE(adaptive), 100);
+	WRITE_ONCE(keydance_adaptive_ns,
+		   div_u64(step_ns * keydance_adaptive_scale,
+			   KEYDANCE_ADAPTIVE_ONE));
+}
+
+static DECLARE_WORK(keydance_adaptive_work, keydance_adaptive_fn);
+
+/* Clear the counters and histograms on every CPU. Increments racing with
+ * this may survive it, which is fine for statistics. */
+static void keydance_stats_reset(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		memset(per_cpu_ptr(&keydance_counters, cpu), 0,
+		       sizeof(struct keydance_counters));
+		memset(per_cpu_ptr(keydance_hists, cpu), 0,
+		       sizeof(struct keydance_hist) * KEYDANCE_NHISTS);
+	}
+	schedule_work(&keydance_adaptive_work);
+}
+
+/* Serializes game start, module exit and the adding and removing of
+   sessions, which have to stop step timers synchronously. The game paths
+   themselves never take it, except the simulator's manual step. */
+static DEFINE_MUTEX(keydance_ctl_mutex);
+
+/* Module life cycle, see keydance_exit(). Set under keydance_ctl_mutex;
+   the game paths only read it. */
+enum keydance_phase {
+	KEYDANCE_UP,		/* loaded and playing */
+	KEYDANCE_STOPPING,	/* no new steps, games or keys */
+};
+
+static int keydance_phase = KEYDANCE_UP;
+
+/* Set under keydance_ctl_mutex while a benchmark runs: no game starts. */
+static bool keydance_benching;
+
+/* Difficulty curve: the step time of every level, the hits it takes to
+ * complete it and the misses that end the game there. A game is won when
+ * the last level is completed. The default curve starts at 2 seconds and
+ * goes 200 ms faster every 10 hits, with 10 misses allowed, for 10 levels.
+ * Another one can be given as curve= at load time or written to
+ * /sys/module/keydance/parameters/curve at any time, as a list of
+ *	step_us:hits:misses[,step_us:hits:misses...]
+ * The curve is computed once when it is set and swapped in with RCU, so
+ * the game paths only index it. Running games use a new curve from their
+ * next step on.
+ */
+#define KEYDANCE_MAX_LEVELS 64	/* the state word keeps 8 bits */
+
+struct keydance_level {
+	u64 step_ns;		/* delay time before the next LED pattern */
+	unsigned int hits;	/* total hits at which the level is done */
+	unsigned int misses;	/* misses that end the game */
+};
+
+struct keydance_curve {
+	struct rcu_head rcu;
+	unsigned int levels;
+	struct keydance_level level[];
+};
+
+static struct keydance_curve __rcu *keydance_curve;
+
+/* step time at @level, 0 once the game is won */
+static u64 keydance_step_ns(const struct keydance_curve *curve,
+			    unsigned int level)
+{
+	u64 floor_ns = READ_ONCE(keydance_step_floor_ns);
+	u64 fast_ns = READ_ONCE(keydance_adaptive_ns);
+
+	if (level >= curve->levels)
+		return 0;
+	if (!READ_ONCE(adaptive) || !fast_ns)
+		return max(curve->level[level].step_ns, floor_ns);
+	fast_ns = min(fast_ns, curve->level[0].step_ns);
+	return max3(fast_ns, floor_ns, (u64)KEYDANCE_STEP_FLOOR_NS);
+}
+
+/* level reached at @hits, starting from @level */
+static unsigned int keydance_level_at(const struct keydance_curve *curve,
+				      unsigned int level, unsigned int hits)
+{
+	while (level < curve->levels && hits >= curve->level[level].hits)
+		level++;
+	return level;
+}
+
+static bool keydance_game_over(const struct keydance_curve *curve,
+			       const struct keydance_snap *s)
+{
+	return s->level >= curve->levels ||
+	       s->misses >= curve->level[s->level].misses;
+}
+
+/* Install @curve, the old one is freed after a grace period. Called with
+ * keydance_ctl_mutex.
+ */
+static void __keydance_curve_replace(struct keydance_curve *curve)
+{
+	struct keydance_curve *old;
+
+	old = rcu_dereference_protected(keydance_curve,
+				lockdep_is_held(&keydance_ctl_mutex));
+	rcu_assign_pointer(keydance_curve, curve);
+	if (old)
+		kfree_rcu(old, rcu);
+}
+
+static int keydance_curve_replace(struct keydance_curve *curve)
+{
+	int error = 0;
+
+	mutex_lock(&keydance_ctl_mutex);
+	if (keydance_phase == KEYDANCE_UP)
+		__keydance_curve_replace(curve);
+	else
+		error = -ENODEV;
+	mutex_unlock(&keydance_ctl_mutex);
+	return error;
+}
+
+/* Drop the curve for good, on unload or a failed load: the curve
+ * parameter stays writable until the module is gone, so the phase
+ * changes under the same lock and later writes fail.
+ */
+static void keydance_curve_release(void)
+{
+	mutex_lock(&keydance_ctl_mutex);
+	WRITE_ONCE(keydance_phase, KEYDANCE_STOPPING);
+	__keydance_curve_replace(NULL);
+	mutex_unlock(&keydance_ctl_mutex);
+}
+
+static struct keydance_curve *keydance_curve_alloc(unsigned int levels)
+{
+	struct keydance_curve *curve;
+
+	curve = kzalloc(sizeof(*curve) + levels * sizeof(curve->level[0]),
+			GFP_KERNEL);
+	if (curve)
+		curve->levels = levels;
+	return curve;
+}
+
+static int keydance_curve_default(void)
+{
+	struct keydance_curve *curve = keydance_curve_alloc(10);
+	unsigned int l;
+	int error;
+
+	if (!curve)
+		return -ENOMEM;
+	for (l = 0; l < curve->levels; l++) {
+		curve->level[l].step_ns = (u64)(20 - 2 * l) * NSEC_PER_SEC / 10;
+		curve->level[l].hits = (l + 1) * 10;
+		curve->level[l].misses = 10;
+	}
+	error = keydance_curve_replace(curve);
+	if (error)
+		kfree(curve);
+	return error;
+}
+
+/* Parse a curve written as step_us:hits:misses,... */
+static struct keydance_curve *keydance_curve_parse(const char *val)
+{
+	unsigned int levels = 1, step_us, hits, misses, total = 0, l;
+	struct keydance_curve *curve;
+	const char *p;
+	int n;
+
+	for (p = val; *p; p++)
+		levels += *p == ',';
+	if (levels > KEYDANCE_MAX_LEVELS)
+		return ERR_PTR(-EINVAL);
+	curve = keydance_curve_alloc(levels);
+	if (!curve)
+		return ERR_PTR(-ENOMEM);
+	for (p = val, l = 0; l < levels; l++, p += n) {
+		if (l && *p++ != ',')
+			goto invalid;
+		if (sscanf(p, "%u:%u:%u%n", &step_us, &hits, &misses, &n) != 3)
+			goto invalid;
+		total += hits;
+		if (!step_us || !hits || !misses || total > 0xffff ||
+		    misses > 0xffff)
+			goto invalid;
+		curve->level[l].step_ns = (u64)step_us * NSEC_PER_USEC;
+		curve->level[l].hits = total;
+		curve->level[l].misses = misses;
+	}
+	if (*p && !(*p == '\n' && !p[1]))
+		goto invalid;
+	return curve;
+invalid:
+	kfree(curve);
+	return ERR_PTR(-EINVAL);
+}
+
+static int keydance_curve_set(const char *val, const struct kernel_param *kp)
+{
+	struct keydance_curve *curve = keydance_curve_parse(val);
+	int error;
+
+	if (IS_ERR(curve))
+		return PTR_ERR(curve);
+	error = keydance_curve_replace(curve);
+	if (error)
+		kfree(curve);
+	return error;
+}
+
+static int keydance_curve_get(char *buf, const struct kernel_param *kp)
+{
+	const struct keydance_curve *curve;
+	unsigned int l, prev = 0;
+	int len = 0;
+
+	rcu_read_lock();
+	curve = rcu_dereference(keydance_curve);
+	for (l = 0; curve && l < curve->levels; l++) {
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%s%llu:%u:%u",
+				 l ? "," : "",
+				 div_u64(curve->level[l].step_ns, NSEC_PER_USEC),
+				 curve->level[l].hits - prev,
+				 curve->level[l].misses);
+		prev = curve->level[l].hits;
+	}
+	rcu_read_unlock();
+	len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+	return len;
+}
+
+static const struct kernel_param_ops keydance_curve_ops = {
+	.set	= keydance_curve_set,
+	.get	= keydance_curve_get,
+};
+module_param_cb(curve, &keydance_curve_ops, NULL, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(curve, "Difficulty: step_us:hits:misses per level, comma separated");
+
+/* Arm the step timer for one step time after the previous expiry, or
+ * after now if @restart. Only called by the timer itself or with the
+ * timer stopped, so ks->expires has a single writer.
+ */
+static void keydance_arm_timer(struct keydance_session *ks, bool restart,
+			       u64 step_ns)
+{
+	s64 delta;
+
+	if (restart)
+		ks->expires = ktime_get();
+	ks->expires = ktime_add_ns(ks->expires, step_ns);
+	/* never re-arm behind keydance_exit() stopping the timer */
+	if (sim == KEYDANCE_SIM_MANUAL ||
+	    READ_ONCE(keydance_phase) != KEYDANCE_UP)
+		return;
+	if (use_hrtimer) {
+		hrtimer_start(&ks->hrtimer, ks->expires, HRTIMER_MODE_ABS);
+		return;
+	}
+	delta = ktime_to_ns(ktime_sub(ks->expires, ktime_get()));
+	mod_timer(&ks->timer,
+		  jiffies + (delta > 0 ? nsecs_to_jiffies(delta) : 0));
+}
+
+/* Stop the step timer and wait for a step in progress. With a step
+ * thread, a kick it has not taken yet is dropped too. */
+static void keydance_stop_timer(struct keydance_session *ks)
+{
+	if (ks->step_task)
+		mutex_lock(&ks->step_mutex);
+	del_timer_sync(&ks->timer);
+	hrtimer_cancel(&ks->hrtimer);
+	if (ks->step_task) {
+		clear_bit(0, &ks->step_kick);
+		mutex_unlock(&ks->step_mutex);
+	}
+}
+
+/* Upcoming LED patterns. Each session draws them in batches from a
+ * prandom state of its own, so the step timer takes the next pattern from
+ * a ring and a work item refills it once it is half empty. The ring has a
+ * single consumer, the step timer or a game start with the timer stopped.
+ * Refills take pattern_lock; the consumer only fills the ring itself if
+ * it ever finds it empty. With seed= set, every game reseeds its session,
+ * so it plays the same sequence each time.
+ */
+static ulong seed;
+module_param(seed, ulong, S_IRUGO);
+MODULE_PARM_DESC(seed, "Fixed pattern seed for reproducible runs (default 0: random)");
+
+static void keydance_patterns_fill(struct keydance_session *ks)
+{
+	unsigned char state;
+	unsigned long flags;
+	unsigned int tail;
+	u32 bits = 0;
+	int n = 0;
+
+	spin_lock_irqsave(&ks->pattern_lock, flags);
+	tail = ks->pattern_tail;
+	while (tail - smp_load_acquire(&ks->pattern_head) < KEYDANCE_PATTERNS) {
+		if (!n) {
+			bits = prandom_u32_state(&ks->rnd);
+			n = 32 / 3;
+		}
+		state = bits & (I8042_LED_CAPSLOCK | I8042_LED_NUMLOCK | \
+				I8042_LED_SCROLLLOCK);
+		bits >>= 3;
+		n--;
+		if (state)		/* no empty patterns */
+			ks->patterns[tail++ % KEYDANCE_PATTERNS] = state;
+	}
+	smp_store_release(&ks->pattern_tail, tail);
+	spin_unlock_irqrestore(&ks->pattern_lock, flags);
+}
+
+static void keydance_patterns_work(struct work_struct *work)
+{
+	keydance_patterns_fill(container_of(work, struct keydance_session,
+					    pattern_work));
+}
+
+static void keydance_patterns_seed(struct keydance_session *ks)
+{
+	u64 s = seed + ks->id;
+
+	if (!seed)
+		get_random_bytes(&s, sizeof(s));
+	prandom_seed_state(&ks->rnd, s);
+	ks->pattern_head = ks->pattern_tail = 0;
+	keydance_patterns_fill(ks);
+}
+
+/* The next non-empty LED pattern for @ks, left in the ring */
+static unsigned char keydance_peek_pattern(struct keydance_session *ks)
+{
+	unsigned int head = ks->pattern_head;
+
+	if (head == smp_load_acquire(&ks->pattern_tail))
+		keydance_patterns_fill(ks);	/* the refill fell behind */
+	return ks->patterns[head % KEYDANCE_PATTERNS];
+}
+
+/* Drop the pattern keydance_peek_pattern() returned */
+static void keydance_pop_pattern(struct keydance_session *ks)
+{
+	unsigned int head = ks->pattern_head;
+
+	smp_store_release(&ks->pattern_head, head + 1);
+	if (READ_ONCE(ks->pattern_tail) - head != KEYDANCE_PATTERNS / 2)
+		return;
+	/* the step thread can afford to refill inline */
+	if (ks->step_task && current == ks->step_task)
+		keydance_patterns_fill(ks);
+	else
+		schedule_work(&ks->pattern_work);
+}
+
+/* A new non-empty LED pattern for @ks */
+static unsigned char keydance_next_pattern(struct keydance_session *ks)
+{
+	unsigned char state = keydance_peek_pattern(ks);
+
+	keydance_pop_pattern(ks);
+	return state;
+}
+
+/* LED and key hardware backend, chosen once at load time. set_leds() may
+ * be called from timer, hard irq and irq thread context and must never
+ * wait for the hardware. It calls @get for the state to show under the
+ * lock that orders its own updates, so concurrent updaters can not post
+ * out of order and leave a stale pattern behind. Backends with read_key()
+ * can take the keyboard interrupt and read scancodes from it (see
+ * capture=); the others deliver keys through keydance_queue_key().
+ */
+struct keydance_backend {
+	const char *name;
+	int (*init)(void);
+	void (*exit)(void);		/* also turns the LEDs off */
+	void (*set_leds)(struct keydance_session *ks,
+			 unsigned char (*get)(struct keydance_session *ks));
+	unsigned char (*read_key)(void);
+	void (*led_counts)(u64 *posts, u64 *writes);
+	/* optional, LED protocol errors */
+	void (*led_errors)(unsigned long *resends, unsigned long *timeouts,
+			   unsigned long *failures);
+	void (*calibrated)(void);	/* optional, the self-test is over */
+	bool led_done;			/* calls keydance_led_done() */
+	bool per_device;		/* adds a session per device */
+};
+
+static char *backend = "i8042";
+module_param(backend, charp, S_IRUGO);
+MODULE_PARM_DESC(backend, "LED and key backend: i8042 (default) or input; sim= overrides it");
+
+static const struct keydance_backend *keydance_backend;
+
+/* LED calibration, taken by the backend during the self-test and frozen
+ * once it is over. Shown in /proc/keydance-result. */
+static struct keydance_led_cal {
+	struct i8042_led_time ibf, ack, rtt;
+	u64 poll_ns;
+	bool valid;
+} keydance_led_cal;
+
+static unsigned char keydance_cur_leds(struct keydance_session *ks)
+{
+	struct keydance_snap s;
+
+	keydance_snapshot(ks, &s);
+	return s.lock_state;
+}
+
+static unsigned char keydance_no_leds(struct keydance_session *ks)
+{
+	return 0;
+}
+
+/* Show the current lock_state of @ks on its LEDs. */
+static void keydance_post_leds(struct keydance_session *ks)
+{
+	keydance_backend->set_leds(ks, keydance_cur_leds);
+}
+
+/* Binary stats page, mapped read-only by /dev/keydance-stats users.
+ * Every state change publishes a new copy. Publishers never spin on each
+ * other: whoever finds the page busy just marks it dirty, and the current
+ * writer rewrites it from the latest state before letting go.
+ */
+static struct keydance_stats *keydance_stats_page;
+static unsigned long keydance_stats_flags;
+#define KEYDANCE_STATS_DIRTY	0
+#define KEYDANCE_STATS_BUSY	1
+
+static void keydance_stats_write(struct keydance_stats *p)
+{
+	struct keydance_snap s = { 0 };
+	struct keydance_counters c;
+	struct keydance_session *ks;
+
+	WRITE_ONCE(p->seq, p->seq + 1);
+	smp_wmb();
+	/* the game fields show the first session */
+	rcu_read_lock();
+	ks = rcu_dereference(keydance_sessions[0]);
+	if (ks)
+		keydance_snapshot(ks, &s);
+	p->step_time_ns = keydance_step_ns(rcu_dereference(keydance_curve),
+					  s.level);
+	rcu_read_unlock();
+	p->running = s.running;
+	p->level = s.level;
+	p->hits = s.hits;
+	p->misses = s.misses;
+	keydance_backend->led_counts(&p->led_posts, &p->led_writes);
+	p->update_ns = ktime_get_ns();
+	keydance_counters_sum(&c);
+	p->total_interrupts = c.interrupts;
+	p->total_filtered = c.filtered;
+	p->total_keys = c.keys;
+	p->total_wrong_keys = c.wrong_keys;
+	p->total_hits = c.hits;
+	p->total_misses = c.misses;
+	p->total_patterns = c.patterns;
+	p->total_games = c.games;
+	smp_wmb();
+	WRITE_ONCE(p->seq, p->seq + 1);
+}
+
+static void keydance_stats_publish(void)
+{
+	set_bit(KEYDANCE_STATS_DIRTY, &keydance_stats_flags);
+	smp_mb__after_atomic();
+	while (!test_and_set_bit_lock(KEYDANCE_STATS_BUSY,
+				      &keydance_stats_flags)) {
+		while (test_and_clear_bit(KEYDANCE_STATS_DIRTY,
+					  &keydance_stats_flags))
+			keydance_stats_write(keydance_stats_page);
+		clear_bit_unlock(KEYDANCE_STATS_BUSY, &keydance_stats_flags);
+		smp_mb__after_atomic();
+		/* someone may have marked it dirty while we were busy */
+		if (!test_bit(KEYDANCE_STATS_DIRTY, &keydance_stats_flags))
+			break;
+	}
+}
+
+/* Event ring behind /dev/keydance-events.
+ * Producers (timer, irq thread, proc) reserve a slot with one atomic add
+ * and publish it by storing its index in ev.seq. While a slot is being
+ * rewritten its seq is index - 1, which no reader position in that slot
+ * can match, so readers detect torn and overwritten slots lock-free.
+ */
+#define KEYDANCE_EVENTS 1024	/* must be a power of 2 */
+
+static struct keydance_event keydance_events[KEYDANCE_EVENTS];
+static atomic_t keydance_events_head = ATOMIC_INIT(0);
+static DECLARE_WAIT_QUEUE_HEAD(keydance_events_wait);
+
+/* mark every slot as written one lap ago, i.e. empty */
+static void keydance_events_init(void)
+{
+	u32 i;
+
+	for (i = 0; i < KEYDANCE_EVENTS; i++)
+		keydance_events[i].seq = i - KEYDANCE_EVENTS;
+}
+
+static void keydance_event_at(struct keydance_session *ks, u64 time_ns,
+			      u8 type, u8 pattern, u8 key,
+			      const struct keydance_snap *s)
+{
+	u32 idx = atomic_inc_return(&keydance_events_head) - 1;
+	struct keydance_event *ev = &keydance_events[idx & (KEYDANCE_EVENTS - 1)];
+
+	WRITE_ONCE(ev->seq, idx - 1);
+	smp_wmb();
+	ev->time_ns = time_ns;
+	ev->type = type;
+	ev->pattern = pattern;
+	ev->key = key;
+	ev->level = s->level;
+	ev->hits = s->hits;
+	ev->misses = s->misses;
+	ev->session = ks->id;
+	smp_store_release(&ev->seq, idx);
+
+	smp_mb();
+	if (waitqueue_active(&keydance_events_wait))
+		wake_up_interruptible(&keydance_events_wait);
+}
+
+static inline void keydance_event(struct keydance_session *ks, u8 type,
+				  u8 pattern, u8 key,
+				  const struct keydance_snap *s)
+{
+	keydance_event_at(ks, ktime_get_ns(), type, pattern, key, s);
+}
+
+/* Game log behind /dev/keydance-log: one compact record per step, so a
+ * reader can replay whole games after the fact. Producers reserve a slot
+ * with one atomic add like the event ring, but there is no room for a
+ * seq: a record is published by storing its outcome, which is never 0,
+ * with KEYDANCE_LOG_LAP set on every other lap of the ring. A slot holds
+ * the record for a reader's position only if its outcome is set and has
+ * the lap bit of that position; the head tells whether the reader was
+ * overrun instead.
+ */
+#define KEYDANCE_LOG_RECORDS 8192	/* must be a power of 2 */
+
+static struct keydance_log_record keydance_log[KEYDANCE_LOG_RECORDS];
+static atomic_t keydance_log_head = ATOMIC_INIT(0);
+static DECLARE_WAIT_QUEUE_HEAD(keydance_log_wait);
+
+static inline u8 keydance_log_lap(u32 pos)
+{
+	return pos & KEYDANCE_LOG_RECORDS ? KEYDANCE_LOG_LAP : 0;
+}
+
+/* Log a step of @ks that ended at @now: @pattern was shown, the LEDs in
+ * @keys answered and @wrong other keys pressed. Called by its step timer,
+ * or with that stopped. */
+static void keydance_log_step(struct keydance_session *ks, u64 now,
+			      u8 outcome, u8 pattern, u8 keys, u8 wrong)
+{
+	u32 idx = atomic_inc_return(&keydance_log_head) - 1;
+	struct keydance_log_record *r =
+		&keydance_log[idx & (KEYDANCE_LOG_RECORDS - 1)];
+	u64 delta_us = 0;
+
+	if ((outcome & KEYDANCE_LOG_TYPE) != KEYDANCE_LOG_START)
+		delta_us = div_u64(now - ks->log_ns, NSEC_PER_USEC);
+	ks->log_ns = now;
+	WRITE_ONCE(r->outcome, 0);
+	smp_wmb();
+	r->delta_us = min_t(u64, delta_us, U32_MAX);
+	r->session = ks->id;
+	r->leds = pattern | keys << 4;
+	r->wrong = wrong;
+	smp_store_release(&r->outcome, outcome | keydance_log_lap(idx));
+
+	smp_mb();
+	if (waitqueue_active(&keydance_log_wait))
+		wake_up_interruptible(&keydance_log_wait);
+}
+
+/* Main logics of this game is here 
+ * 1. lock_state should be 0 if users hits all required key 
+ * 2. calculate new lock_state
+ * 3. update extras, hits, misses and level, etc.
+ * 4. update LEDs
+ * 5. set timer for next expire
+ * Runs in the step timer, or in the session's step thread. The pattern
+ * is only taken from the ring once it is shown, so steps that find the
+ * game paused or stopped, or end it, leave the sequence of a seed= game
+ * as it was.
+ */
+static void keydance_step(struct keydance_session *ks)
+{
+	unsigned char pattern = keydance_peek_pattern(ks);
+	const struct keydance_curve *curve;
+	u64 now = ktime_get_ns();
+	struct keydance_snap o, s;
+	u64 old, new, step_ns, shown;
+
+	if (trace_keydance_timer_drift_enabled())
+		trace_keydance_timer_drift(now - ktime_to_ns(ks->expires));
+
+	/* The new pattern's show time goes in before the state, so a key
+	 * scored against the new pattern is timed against it too, and one
+	 * pressed before it was shown gives no reaction sample. */
+	shown = ks->pattern_ns;
+	WRITE_ONCE(ks->pattern_ns, now);
+	rcu_read_lock();
+	curve = rcu_dereference(keydance_curve);
+	do {
+		old = atomic64_read(&ks->state);
+		keydance_unpack(old, &o);
+		if (!o.running || o.paused) {
+			rcu_read_unlock();
+			WRITE_ONCE(ks->pattern_ns, shown);
+			return;
+		}
+		s = o;
+		if (s.lock_state || s.extras)
+			s.misses++;
+		else
+			s.hits++;
+		s.level = keydance_level_at(curve, s.level, s.hits);
+		if (keydance_game_over(curve, &s)) {
+			s.running = false;
+			s.lock_state = 0;
+		} else
+			s.lock_state = pattern;
+		s.extras = 0;
+		new = keydance_pack(&s);
+	} while (atomic64_cmpxchg(&ks->state, old, new) != old);
+	step_ns = keydance_step_ns(curve, s.level);
+	rcu_read_unlock();
+	if (s.running)
+		keydance_pop_pattern(ks);
+
+	keydance_log_step(ks, now, (s.hits != o.hits ? KEYDANCE_LOG_HIT :
+			  KEYDANCE_LOG_MISS) |
+			  (s.level != o.level ? KEYDANCE_LOG_LEVEL : 0) |
+			  (s.running ? 0 : KEYDANCE_LOG_OVER), ks->log_pattern,
+			  ks->log_pattern & ~o.lock_state, o.extras);
+	ks->log_pattern = s.lock_state;
+	if (s.hits != o.hits)
+		keydance_count(hits);
+	else
+		keydance_count(misses);
+	if (READ_ONCE(adaptive))
+		schedule_work(&keydance_adaptive_work);
+	keydance_post_leds(ks);
+	keydance_stats_publish();
+	keydance_event(ks, s.hits != o.hits ? KEYDANCE_EV_HIT : KEYDANCE_EV_MISS,
+		       o.lock_state, 0, &s);
+	if (s.level != o.level)
+		keydance_event(ks, KEYDANCE_EV_LEVEL, 0, 0, &s);
+	if (!s.running) {
+		keydance_event(ks, KEYDANCE_EV_GAME_OVER, 0, 0, &s);
+		return;
+	}
+	keydance_count(patterns);
+	trace_keydance_pattern(s.lock_state, s.level, s.hits, s.misses);
+	keydance_event(ks, KEYDANCE_EV_PATTERN, s.lock_state, 0, &s);
+	keydance_arm_timer(ks, false, step_ns);
+}
+
+/* Step thread mode, step_thread=1: the step timer only kicks a thread of
+ * the session's own, which does the pattern, scoring and LED work. That
+ * keeps it out of softirq (or, with use_hrtimer=1, hard irq) context, and
+ * with step_prio= the game loop runs at a SCHED_FIFO priority, pinned to
+ * step_cpu= if set. The thread steps under step_mutex, so stopping the
+ * timer can wait for a step as del_timer_sync() would.
+ */
+static bool step_thread;
+module_param(step_thread, bool, S_IRUGO);
+MODULE_PARM_DESC(step_thread, "Step games in a kernel thread of their own instead of the timer");
+
+static int step_prio;
+module_param(step_prio, int, S_IRUGO);
+MODULE_PARM_DESC(step_prio, "SCHED_FIFO priority of the step threads, 1-99, 0 = normal (default)");
+
+static int step_cpu = -1;
+module_param(step_cpu, int, S_IRUGO);
+MODULE_PARM_DESC(step_cpu, "CPU to run the step threads on, -1 = any (default)");
+
+static void keydance_timerfn(unsigned long data)
+{
+	struct keydance_session *ks = (struct keydance_session *)data;
+
+	if (!ks->step_task) {
+		keydance_step(ks);
+		return;
+	}
+	set_bit(0, &ks->step_kick);
+	wake_up_process(ks->step_task);
+}
+
+static enum hrtimer_restart keydance_hrtimerfn(struct hrtimer *timer)
+{
+	keydance_timerfn((unsigned long)container_of(timer,
+			 struct keydance_session, hrtimer));
+	return HRTIMER_NORESTART;
+}
+
+static int keydance_step_threadfn(void *data)
+{
+	struct keydance_session *ks = data;
+
+	for (;;) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (kthread_should_stop())
+			break;
+		if (!test_bit(0, &ks->step_kick)) {
+			schedule();
+			continue;
+		}
+		__set_current_state(TASK_RUNNING);
+		mutex_lock(&ks->step_mutex);
+		if (test_and_clear_bit(0, &ks->step_kick))
+			keydance_step(ks);
+		mutex_unlock(&ks->step_mutex);
+	}
+	__set_current_state(TASK_RUNNING);
+	return 0;
+}
+
+static int keydance_step_thread_start(struct keydance_session *ks)
+{
+	struct task_struct *task;
+	int error;
+
+	if (!step_thread)
+		return 0;
+	if (step_cpu >= 0 && (step_cpu >= nr_cpu_ids || !cpu_online(step_cpu)))
+		return -EINVAL;
+	task = kthread_create(keydance_step_threadfn, ks, "keydance/%u",
+			      ks->id);
+	if (IS_ERR(task))
+		return PTR_ERR(task);
+	if (step_cpu >= 0) {
+		error = set_cpus_allowed_ptr(task, cpumask_of(step_cpu));
+		if (error)
+			goto fail;
+	}
+	if (step_prio > 0) {
+		struct sched_param param = {
+			.sched_priority = clamp(step_prio, 1, MAX_RT_PRIO - 1),
+		};
+
+		error = sched_setscheduler(task, SCHED_FIFO, &param);
+		if (error)
+			goto fail;
+	}
+	ks->step_task = task;
+	wake_up_process(task);
+	return 0;
+fail:
+	kthread_stop(task);
+	return error;
+}
+
+/* Called with the step timer stopped for good */
+static void keydance_step_thread_stop(struct keydance_session *ks)
+{
+	if (!ks->step_task)
+		return;
+	kthread_stop(ks->step_task);
+	ks->step_task = NULL;
+}
+
+/* flashing all 3 LEDs 5 times
+ * The self-test runs as delayed work, one toggle per run, so module load
+ * does not wait for it. led_selftest=0 skips it; starting or restoring a
+ * game, a benchmark and unload cancel it. Its writes double as the LED
+ * calibration: once it is over, or cut short, the backend's calibrated()
+ * takes what it measured.
+ */
+static bool led_selftest = true;
+module_param(led_selftest, bool, S_IRUGO);
+MODULE_PARM_DESC(led_selftest, "Flash the LEDs once loaded (default 1)");
+
+#define LED_TEST_DELAY 200  /* ms between toggles */
+#define LED_TEST_TIME 1200  /* ms for the whole test */
+
+static void led_test_fn(struct work_struct *work);
+static DECLARE_DELAYED_WORK(led_test_work, led_test_fn);
+static int led_test_total;
+static char led_test_state;
+static bool led_test_over;
+
+static void led_test_done(void)
+{
+	if (led_test_over)
+		return;
+	led_test_over = true;
+	if (keydance_backend->calibrated)
+		keydance_backend->calibrated();
+}
+
+static unsigned char led_test_leds(struct keydance_session *ks)
+{
+	return led_test_state;
+}
+
+static void led_test_fn(struct work_struct *work)
+{
+	struct keydance_session *ks;
+	int i;
+
+	if (led_test_total >= LED_TEST_TIME) {
+		led_test_done();
+		return;
+	}
+	led_test_state ^= I8042_LED_CAPSLOCK | I8042_LED_NUMLOCK | \
+			  I8042_LED_SCROLLLOCK;
+	rcu_read_lock();
+	keydance_for_each_session(i, ks)
+		keydance_backend->set_leds(ks, led_test_leds);
+	rcu_read_unlock();
+	led_test_total += LED_TEST_DELAY;
+	schedule_delayed_work(&led_test_work, msecs_to_jiffies(LED_TEST_DELAY));
+}
+
+/* Cut the self-test short, if it still runs, and take the calibration it
+ * got so far. Everything that takes over the LEDs calls this first.
+ */
+static void led_test_cancel(void)
+{
+	cancel_delayed_work_sync(&led_test_work);
+	led_test_done();
+}
+
+/* Stop the game of @ks and wait for its timer. The state is cleared
+ * first, so the timer does not re-arm. Called with keydance_ctl_mutex.
+ */
+static void keydance_session_stop(struct keydance_session *ks)
+{
+	atomic64_set(&ks->state, 0);
+	keydance_stop_timer(ks);
+	cancel_work_sync(&ks->pattern_work);
+}
+
+/* Before starting the game:
+ * 1. Reset all states: lock_state, misses, hits, level and etc.
+ * 2. Reset LEDs
+ * 3. setup timer
+ * Called with keydance_ctl_mutex.
+ */
+static unsigned int keydance_first_level;	/* games start here */
+
+static void keydance_session_start(struct keydance_session *ks)
+{
+	const struct keydance_curve *curve;
+	struct keydance_snap s = { .running = true };
+
+	curve = rcu_dereference_protected(keydance_curve,
+				lockdep_is_held(&keydance_ctl_mutex));
+	if (keydance_first_level < curve->levels)
+		s.level = keydance_first_level;
+	if (s.level)
+		s.hits = curve->level[s.level - 1].hits;
+	keydance_session_stop(ks);
+	if (seed)
+		keydance_patterns_seed(ks);
+	s.lock_state = keydance_next_pattern(ks);
+	WRITE_ONCE(ks->pattern_ns, ktime_get_ns());
+	ks->log_pattern = s.lock_state;
+	keydance_log_step(ks, ks->pattern_ns, KEYDANCE_LOG_START,
+			  s.lock_state, 0, 0);
+	atomic64_set(&ks->state, keydance_pack(&s));
+	keydance_count(games);
+	keydance_count(patterns);
+	keydance_post_leds(ks);
+	keydance_event(ks, KEYDANCE_EV_START, 0, 0, &s);
+	trace_keydance_pattern(s.lock_state, s.level, s.hits, s.misses);
+	keydance_event(ks, KEYDANCE_EV_PATTERN, s.lock_state, 0, &s);
+	keydance_arm_timer(ks, true, keydance_step_ns(curve, s.level));
+}
+
+static void keydance_session_init(struct keydance_session *ks,
+				  const char *name)
+{
+	atomic64_set(&ks->state, 0);
+	setup_timer(&ks->timer, keydance_timerfn, (unsigned long)ks);
+	hrtimer_init(&ks->hrtimer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	ks->hrtimer.function = keydance_hrtimerfn;
+	mutex_init(&ks->step_mutex);
+	INIT_KFIFO(ks->keys);
+	spin_lock_init(&ks->key_lock);
+	spin_lock_init(&ks->led_lock);
+	spin_lock_init(&ks->pattern_lock);
+	INIT_WORK(&ks->pattern_work, keydance_patterns_work);
+	keydance_patterns_seed(ks);
+	ks->name = name;
+}
+
+/* Give @ks the first free id and make it visible. Called with
+ * keydance_ctl_mutex.
+ */
+static int keydance_session_add(struct keydance_session *ks)
+{
+	int i, error;
+
+	for (i = 0; i < KEYDANCE_MAX_SESSIONS; i++)
+		if (!rcu_access_pointer(keydance_sessions[i])) {
+			ks->id = i;
+			error = keydance_step_thread_start(ks);
+			if (error)
+				return error;
+			rcu_assign_pointer(keydance_sessions[i], ks);
+			return 0;
+		}
+	return -ENOSPC;
+}
+
+/* Stop the game of @ks and hide it. It may be freed once an RCU grace
+ * period has passed. Called with keydance_ctl_mutex.
+ */
+static void keydance_session_del(struct keydance_session *ks)
+{
+	keydance_session_stop(ks);
+	keydance_step_thread_stop(ks);
+	RCU_INIT_POINTER(keydance_sessions[ks->id], NULL);
+}
+
+/* Start a game in every session. Called with keydance_ctl_mutex. */
+static void __keydance_start(void)
+{
+	struct keydance_session *ks;
+	int i;
+
+	led_test_cancel();
+	keydance_for_each_session(i, ks)
+		keydance_session_start(ks);
+}
+
+static void keydance_start(void)
+{
+	mutex_lock(&keydance_ctl_mutex);
+	if (keydance_phase == KEYDANCE_UP && !keydance_benching) {
+		__keydance_start();
+		keydance_stats_publish();
+	}
+	mutex_unlock(&keydance_ctl_mutex);
+}
+
+/* End the game of every session. Called with keydance_ctl_mutex. */
+static void __keydance_stop(void)
+{
+	struct keydance_session *ks;
+	struct keydance_snap s;
+	int i;
+
+	keydance_for_each_session(i, ks) {
+		keydance_snapshot(ks, &s);
+		keydance_session_stop(ks);
+		keydance_post_leds(ks);
+		if (s.running) {
+			keydance_log_step(ks, ktime_get_ns(), KEYDANCE_LOG_STOP |
+					  KEYDANCE_LOG_OVER, ks->log_pattern,
+					  ks->log_pattern & ~s.lock_state,
+					  s.extras);
+			s.running = false;
+			keydance_event(ks, KEYDANCE_EV_GAME_OVER, 0, 0, &s);
+		}
+	}
+}
+
+/* Suspend the game of @ks, keeping its state. The paused bit goes in
+ * first, so a step timer already running gives up and keys are dropped
+ * from the hard IRQ on; then the timer is stopped and what was left of
+ * the step is kept for keydance_session_resume(). Called with
+ * keydance_ctl_mutex.
+ */
+static void keydance_session_pause(struct keydance_session *ks)
+{
+	struct keydance_snap s;
+	u64 old, new, now;
+	s64 left;
+
+	do {
+		old = atomic64_read(&ks->state);
+		keydance_unpack(old, &s);
+		if (!s.running || s.paused)
+			return;
+		s.paused = true;
+		new = keydance_pack(&s);
+	} while (atomic64_cmpxchg(&ks->state, old, new) != old);
+	keydance_stop_timer(ks);
+	now = ktime_get_ns();
+	left = ktime_to_ns(ks->expires) - now;
+	ks->remaining_ns = left > 0 ? left : 0;
+	ks->paused_ns = now;
+	keydance_log_step(ks, now, KEYDANCE_LOG_PAUSE, ks->log_pattern,
+			  ks->log_pattern & ~s.lock_state, s.extras);
+	keydance_event(ks, KEYDANCE_EV_PAUSE, s.lock_state, 0, &s);
+}
+
+/* Resume a paused game with the rest of its step. The pattern's show time
+ * moves by the pause, so reaction times do not count it. Called with
+ * keydance_ctl_mutex.
+ */
+static void keydance_session_resume(struct keydance_session *ks)
+{
+	struct keydance_snap s;
+	u64 old, new, now;
+
+	do {
+		old = atomic64_read(&ks->state);
+		keydance_unpack(old, &s);
+		if (!s.paused)
+			return;
+		s.paused = false;
+		new = keydance_pack(&s);
+	} while (atomic64_cmpxchg(&ks->state, old, new) != old);
+	now = ktime_get_ns();
+	WRITE_ONCE(ks->pattern_ns, ks->pattern_ns + now - ks->paused_ns);
+	keydance_log_step(ks, now, KEYDANCE_LOG_RESUME, ks->log_pattern,
+			  ks->log_pattern & ~s.lock_state, s.extras);
+	keydance_event(ks, KEYDANCE_EV_RESUME, s.lock_state, 0, &s);
+	keydance_arm_timer(ks, true, ks->remaining_ns);
+}
+
+/* Commands for /proc/keydance-start, one per line:
+ *	start		start a game in every session; so does "1"
+ *	stop		end every game
+ *	level N		start games at level N
+ *	seed N		fixed pattern seed, 0 for random
+ *	curve SPEC	difficulty curve, as the curve= parameter
+ *	reset		clear the counters and histograms
+ *	pause		suspend every game, see keydance_session_pause()
+ *	resume		resume them
+ * A write is parsed whole before anything happens, and an unknown or bad
+ * command fails it with nothing applied. The commands are then applied
+ * together under keydance_ctl_mutex as curve, seed, level, reset, stop,
+ * start, then the last of pause or resume, whatever order they were
+ * written in, so "curve ...", "level 3" and "start" in one write start
+ * the new game on the new curve.
+ */
+struct keydance_cmds {
+	bool start, stop, reset, set_level, set_seed;
+	bool set_pause, pause;
+	unsigned int level;
+	unsigned long seed;
+	struct keydance_curve *curve;
+};
+
+static int keydance_cmd_parse(struct keydance_cmds *c, char *line)
+{
+	char *arg;
+
+	line = strim(line);
+	arg = strpbrk(line, " \t");
+	if (arg) {
+		*arg++ = '\0';
+		arg = skip_spaces(arg);
+	}
+	if (!*line)
+		return 0;
+	if (!strcmp(line, "start") || !strcmp(line, "1"))
+		c->start = true;
+	else if (!strcmp(line, "stop"))
+		c->stop = true;
+	else if (!strcmp(line, "reset"))
+		c->reset = true;
+	else if (!strcmp(line, "pause") || !strcmp(line, "resume")) {
+		c->set_pause = true;
+		c->pause = line[1] == 'a';
+	}
+	else if (!strcmp(line, "level") && arg) {
+		c->set_level = true;
+		return kstrtouint(arg, 0, &c->level);
+	} else if (!strcmp(line, "seed") && arg) {
+		c->set_seed = true;
+		return kstrtoul(arg, 0, &c->seed);
+	} else if (!strcmp(line, "curve") && arg) {
+		kfree(c->curve);
+		c->curve = keydance_curve_parse(arg);
+		if (IS_ERR(c->curve)) {
+			int error = PTR_ERR(c->curve);
+
+			c->curve = NULL;
+			return error;
+		}
+	} else
+		return -EINVAL;
+	return 0;
+}
+
+static int keydance_cmds_apply(struct keydance_cmds *c)
+{
+	const struct keydance_curve *curve;
+	struct keydance_session *ks;
+	int i;
+
+	mutex_lock(&keydance_ctl_mutex);
+	if (keydance_phase != KEYDANCE_UP) {
+		mutex_unlock(&keydance_ctl_mutex);
+		return -ENODEV;
+	}
+	curve = c->curve ?: rcu_dereference_protected(keydance_curve,
+				lockdep_is_held(&keydance_ctl_mutex));
+	if (c->set_level && c->level >= curve->levels) {
+		mutex_unlock(&keydance_ctl_mutex);
+		return -EINVAL;
+	}
+	if (c->start && keydance_benching) {
+		mutex_unlock(&keydance_ctl_mutex);
+		return -EBUSY;
+	}
+	if (c->curve) {
+		__keydance_curve_replace(c->curve);
+		c->curve = NULL;
+	}
+	if (c->set_seed)
+		seed = c->seed;
+	if (c->set_level)
+		keydance_first_level = c->level;
+	if (c->reset)
+		keydance_stats_reset();
+	if (c->stop)
+		__keydance_stop();
+	if (c->start)
+		__keydance_start();
+	if (c->set_pause)
+		keydance_for_each_session(i, ks) {
+			if (c->pause)
+				keydance_session_pause(ks);
+			else
+				keydance_session_resume(ks);
+		}
+	keydance_stats_publish();
+	mutex_unlock(&keydance_ctl_mutex);
+	return 0;
+}
+
+static ssize_t write_keydance_start(struct file *file, const char __user *buf,
+                                    size_t count, loff_t *ppos)
+{
+	struct keydance_cmds c = { };
+	char *cmds, *p, *line;
+	int error = 0;
+
+	if (count >= PAGE_SIZE)
+		return -EINVAL;
+	cmds = kmalloc(count + 1, GFP_KERNEL);
+	if (!cmds)
+		return -ENOMEM;
+	if (copy_from_user(cmds, buf, count)) {
+		kfree(cmds);
+		return -EFAULT;
+	}
+	cmds[count] = '\0';
+	p = cmds;
+	while (!error && (line = strsep(&p, "\n")))
+		error = keydance_cmd_parse(&c, line);
+	/* anyone may start and stop games, the rest is for the admin */
+	if (!error && (c.reset || c.set_level || c.set_seed || c.set_pause ||
+		       c.curve) && !capable(CAP_SYS_ADMIN))
+		error = -EPERM;
+	if (!error)
+		error = keydance_cmds_apply(&c);
+	kfree(c.curve);
+	kfree(cmds);
+	return error ?: count;
+}
+
+/* /proc/keydance-start is write only, see keydance_cmd_parse() */
+static const struct file_operations keydance_start_proc_fops = {
+        .write = write_keydance_start,
+};
+
+/* /proc/keydance-result
+ * This file shows game status. It is rendered into a buffer that opens
+ * share until the stats change, or the histograms may have, so frequent
+ * readers only copy text out. Each open keeps the rendering it started
+ * with, so a file read in pieces stays consistent. A rerender goes into
+ * whichever of two static buffers is neither the latest nor open, then
+ * becomes the latest. Only if files opened on the older rendering are
+ * still open is a buffer allocated for it, freed once it is neither the
+ * latest nor open, so holding the file open never freezes the output.
+ */
+#define KEYDANCE_RESULT_SIZE	8000
+#define KEYDANCE_RESULT_AGE_NS	NSEC_PER_SEC	/* max age of a rendering */
+
+struct keydance_result {
+	unsigned int users;	/* open files reading it */
+	bool alloced;		/* not one of keydance_results[] */
+	u32 seq;		/* of the stats page when rendered */
+	u64 time_ns;
+	size_t len;
+	char buf[KEYDANCE_RESULT_SIZE];
+};
+
+static struct keydance_result keydance_results[2];
+static struct keydance_result *keydance_result;	/* latest rendering */
+static DEFINE_MUTEX(keydance_result_mutex);	/* protects it and users */
+
+static __printf(2, 3)
+void keydance_result_printf(struct keydance_result *r, const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	r->len += vscnprintf(r->buf + r->len, sizeof(r->buf) - r->len,
+			     fmt, args);
+	va_end(args);
+}
+
+static void keydance_result_time(struct keydance_result *r,
+				 const char *name,
+				 const struct i8042_led_time *t)
+{
+	if (!t->count)
+		return;
+	keydance_result_printf(r, "%-12s %10lu %8llu %8llu %8llu\n", name,
+		   t->count, div_u64(t->min_ns, NSEC_PER_USEC),
+		   div_u64(i8042_led_time_avg(t), NSEC_PER_USEC),
+		   div_u64(t->max_ns, NSEC_PER_USEC));
+}
+
+static void keydance_result_render(struct keydance_result *r)
+{
+	const struct keydance_curve *curve;
+	struct keydance_session *ks;
+	struct keydance_counters c;
+	struct keydance_hist h;
+	struct keydance_snap s;
+	unsigned long resends, timeouts, failures;
+	bool running = false;
+	u64 posts, writes;
+	char name[16];
+	u64 total;
+	int i;
+
+	mutex_lock(&keydance_ctl_mutex);
+	curve = rcu_dereference_protected(keydance_curve,
+				lockdep_is_held(&keydance_ctl_mutex));
+	keydance_for_each_session(i, ks) {
+		keydance_snapshot(ks, &s);
+		running |= s.running;
+	}
+	if (!running)
+		keydance_result_printf(r, "**** STOPPED ****\n" \
+		           "To start: echo 1 > /proc/%s\n" \
+			   "Game over when misses >= %d, won after level %d\n", \
+			   keydance_start_fname, curve->level[0].misses, \
+			   curve->levels - 1);
+	else
+		keydance_result_printf(r, ">>>> RUNNING >>>>\n");
+	keydance_for_each_session(i, ks) {
+		keydance_snapshot(ks, &s);
+		if (ks == &keydance_main)
+			keydance_result_printf(r, "\nGame stats%s:\n",
+				   s.paused ? " (paused)" : "");
+		else
+			keydance_result_printf(r, "\nSession %u, %s%s:\n", ks->id,
+				   ks->name, !s.running ? " (stopped)" :
+				   s.paused ? " (paused)" : "");
+		keydance_result_printf(r, "Level: %d (step time = %d ms)\n" \
+			   "Hits: %d, Misses: %d\n", \
+			   s.level, \
+			   (int)div_u64(keydance_step_ns(curve, s.level), NSEC_PER_MSEC), \
+			   s.hits, s.misses);
+	}
+	mutex_unlock(&keydance_ctl_mutex);
+	keydance_counters_sum(&c);
+	keydance_backend->led_counts(&posts, &writes);
+	keydance_result_printf(r, "\nLED writes: %llu (of %llu updates, %s backend)\n", \
+		   writes, posts, keydance_backend->name);
+	if (keydance_backend->led_errors) {
+		keydance_backend->led_errors(&resends, &timeouts, &failures);
+		keydance_result_printf(r, "LED bytes resent: %lu, unanswered: %lu, " \
+			   "failed writes: %lu\n", resends, timeouts, failures);
+	}
+	if (smp_load_acquire(&keydance_led_cal.valid)) {
+		keydance_result_printf(r, "\n%-12s %10s %8s %8s %8s\n",
+			   "LED cal.(us)", "count", "min", "avg", "max");
+		keydance_result_time(r, "IBF clear", &keydance_led_cal.ibf);
+		keydance_result_time(r, "ACK", &keydance_led_cal.ack);
+		keydance_result_time(r, "write", &keydance_led_cal.rtt);
+		keydance_result_printf(r, "Step floor: %llu us, IBF poll: %llu us\n",
+			   div_u64(READ_ONCE(keydance_step_floor_ns), NSEC_PER_USEC),
+			   div_u64(keydance_led_cal.poll_ns, NSEC_PER_USEC));
+	}
+	keydance_result_printf(r, "\nSince load:\n" \
+		   "Games: %lu, Patterns: %lu (hits %lu, misses %lu)\n" \
+		   "Keys: %lu, Wrong keys: %lu\n" \
+		   "Interrupts: %lu (filtered %lu)\n", \
+		   c.games, c.patterns, c.hits, c.misses, \
+		   c.keys, c.wrong_keys, c.interrupts, c.filtered);
+	keydance_result_printf(r, "\n%-12s %10s %8s %8s %8s\n",
+		   "Latency(us)", "count", "p50", "p99", "max");
+	for (i = 0; i < KEYDANCE_NHISTS; i++) {
+		total = keydance_hist_sum(i, &h);
+		if (!total)
+			continue;
+		if (i == KEYDANCE_HIST_LED)
+			snprintf(name, sizeof(name), "LED update");
+		else if (i >= KEYDANCE_HIST_LEVEL(0))
+			snprintf(name, sizeof(name), "level %d",
+				 i - KEYDANCE_HIST_LEVEL(0));
+		else
+			snprintf(name, sizeof(name), "%s",
+				 keydance_led_names[i]);
+		keydance_result_printf(r, "%-12s %10llu %8llu %8llu %8llu\n", name, total,
+			   keydance_hist_pct(&h, total, 50),
+			   keydance_hist_pct(&h, total, 99),
+			   div_u64(h.max_ns, NSEC_PER_USEC));
+	}
+}
+
+static int keydance_result_proc_open(struct inode *inode, struct file *file)
+{
+	u32 seq = READ_ONCE(keydance_stats_page->seq);
+	struct keydance_result *r, *spare;
+	u64 now = ktime_get_ns();
+
+	mutex_lock(&keydance_result_mutex);
+	r = keydance_result;
+	if (!r || seq & 1 || r->seq != seq ||
+	    now - r->time_ns > KEYDANCE_RESULT_AGE_NS) {
+		spare = &keydance_results[0];
+		if (spare == r || spare->users)
+			spare = &keydance_results[1];
+		if (spare == r || spare->users) {
+			/* both pinned: rare, and better than stale output */
+			spare = kmalloc(sizeof(*spare), GFP_KERNEL);
+			if (spare) {
+				spare->users = 0;
+				spare->alloced = true;
+			}
+		}
+		if (spare) {
+			spare->seq = seq;
+			spare->time_ns = now;
+			spare->len = 0;
+			keydance_result_render(spare);
+			if (r && r->alloced && !r->users)
+				kfree(r);
+			keydance_result = r = spare;
+		}
+	}
+	if (!r) {
+		mutex_unlock(&keydance_result_mutex);
+		return -ENOMEM;
+	}
+	r->users++;
+	mutex_unlock(&keydance_result_mutex);
+	file->private_data = r;
+	return 0;
+}
+
+static ssize_t keydance_result_proc_read(struct file *file, char __user *buf,
+					 size_t count, loff_t *ppos)
+{
+	struct keydance_result *r = file->private_data;
+
+	return simple_read_from_buffer(buf, count, ppos, r->buf, r->len);
+}
+
+static int keydance_result_proc_release(struct inode *inode, struct file *file)
+{
+	struct keydance_result *r = file->private_data;
+
+	mutex_lock(&keydance_result_mutex);
+	if (!--r->users && r->alloced && r != keydance_result)
+		kfree(r);
+	mutex_unlock(&keydance_result_mutex);
+	return 0;
+}
+
+/* With the file removed, and so every open file released */
+static void keydance_result_exit(void)
+{
+	if (keydance_result && keydance_result->alloced)
+		kfree(keydance_result);
+}
+
+static const struct file_operations keydance_result_proc_fops = {
+        .open           = keydance_result_proc_open,
+        .read           = keydance_result_proc_read,
+        .llseek         = default_llseek,
+        .release        = keydance_result_proc_release,
+};
+
+/* /dev/keydance-stats: read() returns a consistent copy of the stats page,
+ * mmap() maps the page itself read-only.
+ */
+static ssize_t keydance_stats_read(struct file *file, char __user *buf,
+				   size_t count, loff_t *ppos)
+{
+	struct keydance_stats *p = keydance_stats_page;
+	struct keydance_stats copy;
+	u32 seq;
+
+	do {
+		seq = READ_ONCE(p->seq);
+		smp_rmb();
+		copy = *p;
+		smp_rmb();
+	} while ((seq & 1) || READ_ONCE(p->seq) != seq);
+	copy.seq = seq;
+	return simple_read_from_buffer(buf, count, ppos, &copy, sizeof(copy));
+}
+
+static int keydance_stats_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	if (vma->vm_pgoff || vma->vm_end - vma->vm_start != PAGE_SIZE)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+	/* takes a page reference, so mappings outliving the module are safe */
+	return vm_insert_page(vma, vma->vm_start,
+			      virt_to_page(keydance_stats_page));
+}
+
+static const struct file_operations keydance_stats_fops = {
+	.owner		= THIS_MODULE,
+	.read		= keydance_stats_read,
+	.mmap		= keydance_stats_mmap,
+	.llseek		= default_llseek,
+};
+
+/* Save and restore through /dev/keydance-save, see keydance.h. Every
+ * open file has a save buffer of its own in file->private_data: opening
+ * for reading takes the save that all its reads copy from, a write is
+ * collected and applied when its last byte arrives.
+ */
+
+static void keydance_save_take(struct keydance_save *sv)
+{
+	struct keydance_save_session *ss;
+	struct keydance_session *ks;
+	struct keydance_counters c;
+	struct keydance_hist h;
+	struct keydance_snap s;
+	int i;
+
+	memset(sv, 0, sizeof(*sv));
+	sv->magic = KEYDANCE_SAVE_MAGIC;
+	sv->version = KEYDANCE_SAVE_VERSION;
+	sv->size = sizeof(*sv);
+	sv->time_ns = ktime_get_ns();
+	mutex_lock(&keydance_ctl_mutex);
+	keydance_for_each_session(i, ks) {
+		keydance_snapshot(ks, &s);
+		ss = &sv->sessions[i];
+		ss->valid = 1;
+		ss->running = s.running;
+		ss->paused = s.paused;
+		ss->lock_state = s.lock_state;
+		ss->extras = s.extras;
+		ss->level = s.level;
+		ss->hits = s.hits;
+		ss->misses = s.misses;
+	}
+	mutex_unlock(&keydance_ctl_mutex);
+	keydance_counters_sum(&c);
+	sv->totals[0] = c.interrupts;
+	sv->totals[1] = c.filtered;
+	sv->totals[2] = c.keys;
+	sv->totals[3] = c.wrong_keys;
+	sv->totals[4] = c.hits;
+	sv->totals[5] = c.misses;
+	sv->totals[6] = c.patterns;
+	sv->totals[7] = c.games;
+	for (i = 0; i < KEYDANCE_NHISTS; i++) {
+		keydance_hist_sum(i, &h);
+		memcpy(sv->hists[i].count, h.count, sizeof(h.count));
+		sv->hists[i].max_ns = h.max_ns;
+	}
+}
+
+/* Put a saved game back into @ks and resume it with a fresh step, or
+ * leave it paused with a fresh step to go. Called with keydance_ctl_mutex.
+ */
+static void keydance_session_restore(struct keydance_session *ks,
+				     const struct keydance_save_session *ss,
+				     const struct keydance_curve *curve)
+{
+	struct keydance_snap s = {
+		.lock_state = ss->lock_state & (I8042_LED_CAPSLOCK | \
+				I8042_LED_NUMLOCK | I8042_LED_SCROLLLOCK),
+		.extras = ss->extras,
+		.hits = ss->hits,
+		.misses = ss->misses,
+		.level = ss->level,
+		.running = ss->running,
+		.paused = ss->running && ss->paused,
+	};
+	u64 now = ktime_get_ns();
+
+	keydance_session_stop(ks);
+	WRITE_ONCE(ks->pattern_ns, now);
+	ks->paused_ns = now;
+	ks->log_pattern = s.lock_state;
+	if (s.running)
+		keydance_log_step(ks, now, KEYDANCE_LOG_START, s.lock_state,
+				  0, s.extras);
+	ks->remaining_ns = keydance_step_ns(curve, s.level);
+	atomic64_set(&ks->state, keydance_pack(&s));
+	keydance_post_leds(ks);
+	if (s.running && !s.paused)
+		keydance_arm_timer(ks, true, ks->remaining_ns);
+}
+
+/* Games go back into the sessions with the same id. The counters and
+ * histograms are replaced: every CPU's copy is cleared and the saved
+ * totals are added back through this_cpu ops, so increments racing with
+ * the restore may be lost but the sums stay consistent.
+ */
+static int keydance_save_restore(const struct keydance_save *sv)
+{
+	const struct keydance_curve *curve;
+	struct keydance_session *ks;
+	int i, b;
+
+	mutex_lock(&keydance_ctl_mutex);
+	if (keydance_phase != KEYDANCE_UP) {
+		mutex_unlock(&keydance_ctl_mutex);
+		return -ENODEV;
+	}
+	if (keydance_benching) {
+		mutex_unlock(&keydance_ctl_mutex);
+		return -EBUSY;
+	}
+	led_test_cancel();
+	curve = rcu_dereference_protected(keydance_curve,
+				lockdep_is_held(&keydance_ctl_mutex));
+	keydance_for_each_session(i, ks)
+		if (sv->sessions[i].valid)
+			keydance_session_restore(ks, &sv->sessions[i], curve);
+	keydance_stats_reset();
+	this_cpu_add(keydance_counters.interrupts, sv->totals[0]);
+	this_cpu_add(keydance_counters.filtered, sv->totals[1]);
+	this_cpu_add(keydance_counters.keys, sv->totals[2]);
+	this_cpu_add(keydance_counters.wrong_keys, sv->totals[3]);
+	this_cpu_add(keydance_counters.hits, sv->totals[4]);
+	this_cpu_add(keydance_counters.misses, sv->totals[5]);
+	this_cpu_add(keydance_counters.patterns, sv->totals[6]);
+	this_cpu_add(keydance_counters.games, sv->totals[7]);
+	for (i = 0; i < KEYDANCE_NHISTS; i++) {
+		for (b = 0; b < KEYDANCE_HIST_BUCKETS; b++)
+			if (sv->hists[i].count[b])
+				this_cpu_add(keydance_hists[i].count[b],
+					     sv->hists[i].count[b]);
+		this_cpu_write(keydance_hists[i].max_ns, sv->hists[i].max_ns);
+	}
+	keydance_stats_publish();
+	mutex_unlock(&keydance_ctl_mutex);
+	return 0;
+}
+
+static struct miscdevice keydance_stats_dev = {
+	.minor		= MISC_DYNAMIC_MINOR,
+	.name		= "keydance-stats",
+	.fops		= &keydance_stats_fops,
+	.mode		= S_IRUGO,
+};
+
+static int keydance_save_open(struct inode *inode, struct file *file)
+{
+	struct keydance_save *sv;
+
+	/* reading and writing one buffer would mix a save and a restore */
+	if ((file->f_mode & FMODE_READ) && (file->f_mode & FMODE_WRITE))
+		return -EINVAL;
+	sv = vzalloc(sizeof(*sv));
+	if (!sv)
+		return -ENOMEM;
+	if (file->f_mode & FMODE_READ)
+		keydance_save_take(sv);
+	file->private_data = sv;
+	return 0;
+}
+
+static int keydance_save_release(struct inode *inode, struct file *file)
+{
+	vfree(file->private_data);
+	return 0;
+}
+
+static ssize_t keydance_save_read(struct file *file, char __user *buf,
+				  size_t count, loff_t *ppos)
+{
+	return simple_read_from_buffer(buf, count, ppos, file->private_data,
+				       sizeof(struct keydance_save));
+}
+
+static ssize_t keydance_save_write(struct file *file, const char __user *buf,
+				   size_t count, loff_t *ppos)
+{
+	struct keydance_save *sv = file->private_data;
+	ssize_t ret;
+	int error;
+
+	if (*ppos + count > sizeof(*sv))
+		return -EFBIG;
+	ret = simple_write_to_buffer(sv, sizeof(*sv), ppos, buf, count);
+	if (ret <= 0 || *ppos != sizeof(*sv))
+		return ret;
+	if (sv->magic != KEYDANCE_SAVE_MAGIC ||
+	    sv->version != KEYDANCE_SAVE_VERSION ||
+	    sv->size != sizeof(*sv))
+		return -EINVAL;
+	error = keydance_save_restore(sv);
+	return error ?: ret;
+}
+
+static const struct file_operations keydance_save_fops = {
+	.owner		= THIS_MODULE,
+	.open		= keydance_save_open,
+	.release	= keydance_save_release,
+	.read		= keydance_save_read,
+	.write		= keydance_save_write,
+	.llseek		= default_llseek,
+};
+
+static struct miscdevice keydance_save_dev = {
+	.minor		= MISC_DYNAMIC_MINOR,
+	.name		= "keydance-save",
+	.fops		= &keydance_save_fops,
+	.mode		= S_IRUSR | S_IWUSR,
+};
+
+/* /dev/keydance-events: each open file keeps its own read position in
+ * file->private_data, starting at the next new event.
+ */
+static inline u32 keydance_events_pos(struct file *file)
+{
+	return (u32)(unsigned long)file->private_data;
+}
+
+/* true once the slot at @pos is written or overwritten */
+static bool keydance_events_avail(u32 pos)
+{
+	u32 seq = smp_load_acquire(&keydance_events[pos & (KEYDANCE_EVENTS - 1)].seq);
+
+	return (s32)(seq - pos) >= 0;
+}
+
+/* Copy out the event at *@pos. Returns 1 on success, 0 if it has not been
+ * written yet, or -1 after skipping ahead because the ring overran us.
+ */
+static int keydance_events_get(u32 *pos, struct keydance_event *ev)
+{
+	struct keydance_event *slot = &keydance_events[*pos & (KEYDANCE_EVENTS - 1)];
+	u32 seq = smp_load_acquire(&slot->seq);
+
+	if (seq == *pos) {
+		*ev = *slot;
+		smp_rmb();
+		if (READ_ONCE(slot->seq) == *pos) {
+			(*pos)++;
+			return 1;
+		}
+	} else if ((s32)(seq - *pos) < 0)
+		return 0;
+	/* overwritten; restart half a ring behind the producers */
+	*pos = (u32)atomic_read(&keydance_events_head) - KEYDANCE_EVENTS / 2;
+	return -1;
+}
+
+static ssize_t keydance_events_read(struct file *file, char __user *buf,
+				    size_t count, loff_t *ppos)
+{
+	u32 pos = keydance_events_pos(file);
+	struct keydance_event ev;
+	size_t done = 0;
+	int ret;
+
+	if (count < sizeof(ev))
+		return -EINVAL;
+	while (done + sizeof(ev) <= count) {
+		ret = keydance_events_get(&pos, &ev);
+		if (ret < 0)
+			continue;
+		if (ret == 0) {
+			if (done)
+				break;
+			if (file->f_flags & O_NONBLOCK)
+				return -EAGAIN;
+			if (wait_event_interruptible(keydance_events_wait,
+						keydance_events_avail(pos)))
+				return -ERESTARTSYS;
+			continue;
+		}
+		if (copy_to_user(buf + done, &ev, sizeof(ev))) {
+			if (!done)
+				return -EFAULT;
+			pos--;
+			break;
+		}
+		done += sizeof(ev);
+	}
+	file->private_data = (void *)(unsigned long)pos;
+	return done;
+}
+
+static unsigned int keydance_events_poll(struct file *file, poll_table *wait)
+{
+	poll_wait(file, &keydance_events_wait, wait);
+	if (keydance_events_avail(keydance_events_pos(file)))
+		return POLLIN | POLLRDNORM;
+	return 0;
+}
+
+static int keydance_events_open(struct inode *inode, struct file *file)
+{
+	file->private_data =
+		(void *)(unsigned long)(u32)atomic_read(&keydance_events_head);
+	return nonseekable_open(inode, file);
+}
+
+static const struct file_operations keydance_events_fops = {
+	.owner		= THIS_MODULE,
+	.open		= keydance_events_open,
+	.read		= keydance_events_read,
+	.poll		= keydance_events_poll,
+	.llseek		= no_llseek,
+};
+
+static struct miscdevice keydance_events_dev = {
+	.minor		= MISC_DYNAMIC_MINOR,
+	.name		= "keydance-events",
+	.fops		= &keydance_events_fops,
+	.mode		= S_IRUGO,
+};
+
+/* /dev/keydance-log: each open file starts at the oldest record still in
+ * the ring, so it first replays what the ring holds and then follows new
+ * games. Records are copied out in batches; when the producers overran
+ * the reader, it gets a KEYDANCE_LOG_LOST record and continues half a
+ * ring behind them. There is no splice_read: the default splice path
+ * reads through keydance_log_read() as well.
+ */
+#define KEYDANCE_LOG_BATCH 64	/* records per copy_to_user() */
+
+static inline u32 keydance_log_pos(struct file *file)
+{
+	return (u32)(unsigned long)file->private_data;
+}
+
+/* true once there is a record, or a loss, to report at @pos */
+static bool keydance_log_avail(u32 pos)
+{
+	u8 outcome;
+
+	if ((u32)atomic_read(&keydance_log_head) - pos > KEYDANCE_LOG_RECORDS)
+		return true;
+	outcome = smp_load_acquire(&keydance_log[pos &
+				   (KEYDANCE_LOG_RECORDS - 1)].outcome);
+	return (outcome & KEYDANCE_LOG_TYPE) &&
+	       (outcome & KEYDANCE_LOG_LAP) == keydance_log_lap(pos);
+}
+
+/* Copy up to @max records from *@pos into @out. Returns how many, stopping
+ * at the first one not written yet. */
+static unsigned int keydance_log_get(u32 *pos, struct keydance_log_record *out,
+				     unsigned int max)
+{
+	const struct keydance_log_record *r;
+	unsigned int n = 0;
+	u32 lost;
+	u8 outcome;
+
+	lost = (u32)atomic_read(&keydance_log_head) - *pos;
+	if (lost > KEYDANCE_LOG_RECORDS) {
+		lost -= KEYDANCE_LOG_RECORDS / 2;
+		memset(out, 0, sizeof(*out));
+		out->delta_us = lost;
+		out->outcome = KEYDANCE_LOG_LOST;
+		*pos += lost;
+		return 1;
+	}
+	while (n < max) {
+		r = &keydance_log[*pos & (KEYDANCE_LOG_RECORDS - 1)];
+		outcome = smp_load_acquire(&r->outcome);
+		if (!(outcome & KEYDANCE_LOG_TYPE) ||
+		    (outcome & KEYDANCE_LOG_LAP) != keydance_log_lap(*pos))
+			break;
+		out[n] = *r;
+		smp_rmb();
+		if (READ_ONCE(r->outcome) != outcome)
+			break;		/* being rewritten, caught next time */
+		out[n].outcome &= ~KEYDANCE_LOG_LAP;
+		n++;
+		(*pos)++;
+	}
+	return n;
+}
 
-/* Game statistics */
-static bool game_running = false; /* two modes: running and stop mode */ 
-static int extras;  /* wrong key pressed? To indicate a miss */
-static int misses;  /* Total patterns players reacts wrong */
-static int hits;    /* Total patterns players reacts correctly */
-static int level;   /* Game level, control pattern changing speed */
+static ssize_t keydance_log_read(struct file *file, char __user *buf,
+				 size_t count, loff_t *ppos)
+{
+	struct keydance_log_record batch[KEYDANCE_LOG_BATCH];
+	u32 pos = keydance_log_pos(file), start;
+	size_t done = 0, len;
+	unsigned int n;
 
-#define HITS_PER_LEVEL 10  /* increase game level every 10 hits */
-#define MISSES_TO_STOP 10  /* stop game when misses >= 10 */
-#define LEVEL_TO_STOP 10   /* stop game when level = 10 */
+	if (count < sizeof(batch[0]))
+		return -EINVAL;
+	while (done + sizeof(batch[0]) <= count) {
+		start = pos;
+		n = keydance_log_get(&pos, batch,
+				     min_t(size_t, KEYDANCE_LOG_BATCH,
+					   (count - done) / sizeof(batch[0])));
+		if (!n) {
+			if (done)
+				break;
+			if (file->f_flags & O_NONBLOCK)
+				return -EAGAIN;
+			if (wait_event_interruptible(keydance_log_wait,
+						keydance_log_avail(pos)))
+				return -ERESTARTSYS;
+			continue;
+		}
+		len = n * sizeof(batch[0]);
+		if (copy_to_user(buf + done, batch, len)) {
+			pos = start;
+			if (!done)
+				return -EFAULT;
+			break;
+		}
+		done += len;
+	}
+	file->private_data = (void *)(unsigned long)pos;
+	return done;
+}
 
-/* delay time before changing to next LED pattern */
-static int step_time(int level)
+static unsigned int keydance_log_poll(struct file *file, poll_table *wait)
 {
-	return HZ*(20-2*level)/10;
+	poll_wait(file, &keydance_log_wait, wait);
+	if (keydance_log_avail(keydance_log_pos(file)))
+		return POLLIN | POLLRDNORM;
+	return 0;
 }
 
-/* Main logics of this game is here 
- * 1. lock_state should be 0 if users hits all required key 
- * 2. calculate new lock_state
- * 3. update extras, hits, misses and level, etc.
- * 4. update LEDs
- * 5. set timer for next expire
- */
-static void keydance_timerfn(unsigned long unused)
+static int keydance_log_open(struct inode *inode, struct file *file)
 {
-	/* WRITE YOUR OWN CODE HERE */
-	return;
+	u32 head = atomic_read(&keydance_log_head);
+
+	file->private_data = (void *)(unsigned long)(head > KEYDANCE_LOG_RECORDS ?
+				head - KEYDANCE_LOG_RECORDS : 0);
+	return nonseekable_open(inode, file);
 }
 
-/* Before starting the game:
- * 1. Reset all states: lock_state, misses, hits, level and etc.
- * 2. Reset LEDs
- * 3. setup timer
+static const struct file_operations keydance_log_fops = {
+	.owner		= THIS_MODULE,
+	.open		= keydance_log_open,
+	.read		= keydance_log_read,
+	.poll		= keydance_log_poll,
+	.llseek		= no_llseek,
+};
+
+static struct miscdevice keydance_log_dev = {
+	.minor		= MISC_DYNAMIC_MINOR,
+	.name		= "keydance-log",
+	.fops		= &keydance_log_fops,
+	.mode		= S_IRUGO,
+};
+
+/* Score a press answering LED @bit in the game state of @ks and show the
+ * LEDs left, leaving the new state in @s. Returns 1 for a hit, 0 for a
+ * wrong key and -1 if no game takes keys. No accounting, see below.
  */
-static ssize_t write_keydance_start(struct file *file, const char __user *buf,
-                                    size_t count, loff_t *ppos)
+static int keydance_score_key(struct keydance_session *ks, unsigned char bit,
+			      struct keydance_snap *s)
 {
-	/* WRITE YOUR OWN CODE HERE */
-        return count;
+	u64 old, new;
+	bool hit;
+
+	do {
+		old = atomic64_read(&ks->state);
+		keydance_unpack(old, s);
+		if (!s->running || s->paused)
+			return -1;
+		hit = s->lock_state & bit;
+		if (hit)
+			s->lock_state &= ~bit;
+		else if (s->extras < 0xff)
+			s->extras++;
+		new = keydance_pack(s);
+	} while (atomic64_cmpxchg(&ks->state, old, new) != old);
+
+	if (hit)
+		keydance_post_leds(ks);
+	return hit;
 }
 
-/* /proc/keydance-start is write only. Define only the write method */
-static const struct file_operations keydance_start_proc_fops = {
-        .write = write_keydance_start,
-};
+/* Apply one press of dance key @code, answering LED @bit and made at
+ * @time_ns, to the game state of @ks */
+static void keydance_handle_key(struct keydance_session *ks,
+				unsigned char code, unsigned char bit,
+				u64 time_ns)
+{
+	struct keydance_snap s;
+	u64 shown, latency = 0;
+	int hit;
+
+	hit = keydance_score_key(ks, bit, &s);
+	if (hit < 0)
+		return;
+	if (hit) {
+		keydance_count(keys);
+		/* pairs with keydance_step(): the cmpxchg above orders it */
+		shown = READ_ONCE(ks->pattern_ns);
+		if (time_ns >= shown) {
+			latency = time_ns - shown;
+			keydance_hist_add(KEYDANCE_HIST_KEY(__ffs(bit)), latency);
+			if (s.level < KEYDANCE_HIST_LEVELS)
+				keydance_hist_add(KEYDANCE_HIST_LEVEL(s.level),
+						  latency);
+		}
+	} else
+		keydance_count(wrong_keys);
+	trace_keydance_key(code, bit, hit, s.lock_state, latency);
+	keydance_event_at(ks, time_ns,
+			  hit ? KEYDANCE_EV_KEY : KEYDANCE_EV_WRONG_KEY,
+			  s.lock_state, bit, &s);
+}
 
-/* /proc/keydance-result seq_file show method 
- * This file shows game status.
+/* Benchmarks, triggered through /sys/kernel/debug/keydance/bench:
+ *	echo "led 1000" > bench	LED round-trips through the LED engine
+ *	echo "input 100000" > bench	dance keys through keydance_score_key()
+ *	echo "timer 1000" > bench	re-arms of a step timer, in the current
+ *				timer mode, with arm cost and delay
+ * Reading the file shows min/mean/p99/max of the last run of each. They
+ * refuse to run during a game and keep games from starting while they
+ * run, which is at most KEYDANCE_BENCH_TIME; a run cut short reports the
+ * samples it took. The input benchmark plays a game of its own in a
+ * session no keyboard feeds, and scores its keys without the counters,
+ * histograms and events of keydance_handle_key(), so the statistics and
+ * the adaptive step never see it.
+ * Runs are serialized by keydance_bench_mutex, not keydance_ctl_mutex,
+ * and can be killed.
  */
-static int keydance_result_proc_show(struct seq_file *m, void *v)
+#define KEYDANCE_BENCH_MAX	1000000
+#define KEYDANCE_BENCH_TIME	(10 * HZ)
+
+static struct dentry *keydance_debugfs;
+static DEFINE_MUTEX(keydance_bench_mutex);
+static struct keydance_session keydance_bench_session;
+static DECLARE_COMPLETION(keydance_bench_done);
+static bool keydance_bench_led;		/* LED benchmark running */
+static cycles_t keydance_bench_end;	/* cycles at LED done */
+static u64 keydance_bench_fired_ns;	/* time the bench timer ran */
+static struct timer_list keydance_bench_timer;
+static struct hrtimer keydance_bench_hrtimer;
+static char keydance_bench_result[4][128];
+
+static int keydance_bench_cmp(const void *a, const void *b)
 {
-	if (!game_running)
-		seq_printf(m, "**** STOPPED ****\n" \
-		           "To start: echo 1 > /proc/%s\n" \
-			   "Game over when misses >= %d\n", \
-			   keydance_start_fname, MISSES_TO_STOP);
-	else
-		seq_printf(m, ">>>> RUNNING >>>>\n");
-	seq_printf(m, "\nGame stats:\n" \
-                   "Level: %d (step time = %d ms)\n" \
-                   "Hits: %d, Misses: %d\n", \
-                   level, jiffies_to_msecs(step_time(level)), \
-		   hits, misses);
-	return 0;
+	u64 x = *(const u64 *)a, y = *(const u64 *)b;
+
+	return x < y ? -1 : x > y;
 }
 
-static int keydance_result_proc_open(struct inode *inode, struct file *file)
+static void keydance_bench_report(char *buf, const char *what,
+				  const char *unit, u64 *v, unsigned int n)
 {
-        return single_open(file, keydance_result_proc_show, NULL);
+	u64 sum = 0;
+	unsigned int i;
+
+	sort(v, n, sizeof(*v), keydance_bench_cmp, NULL);
+	for (i = 0; i < n; i++)
+		sum += v[i];
+	snprintf(buf, sizeof(keydance_bench_result[0]),
+		 "%-10s n=%u min=%llu mean=%llu p99=%llu max=%llu %s\n",
+		 what, n, v[0], div64_u64(sum, n), v[(u64)n * 99 / 100],
+		 v[n - 1], unit);
 }
 
-static const struct file_operations keydance_result_proc_fops = {
-        .open           = keydance_result_proc_open,
-        .read           = seq_read,
-        .llseek         = seq_lseek,
-        .release        = single_release,
-};
+/* Whether a run started at @start has to end early */
+static bool keydance_bench_over(unsigned long start)
+{
+	return fatal_signal_pending(current) ||
+	       time_after(jiffies, start + KEYDANCE_BENCH_TIME);
+}
 
-/* flashing all 3 LEDs 5 times */
-static void led_test(void)
+static int keydance_bench_leds(u64 *v, unsigned int n)
 {
-	int total, delay = 200;
+	unsigned long begin = jiffies;
 	char state = 0;
+	cycles_t start;
+	unsigned int i;
+	long left;
+	int error = 0;
 
-	for (total = 0; total < 1200; ) {
+	if (!keydance_backend->led_done)
+		return -EOPNOTSUPP;
+	WRITE_ONCE(keydance_bench_led, true);
+	for (i = 0; i < n && !keydance_bench_over(begin); i++) {
+		/* a new state every time, so coalescing can not skip it */
 		state ^= I8042_LED_CAPSLOCK | I8042_LED_NUMLOCK | \
-                         I8042_LED_SCROLLLOCK;
-		total += i8042_led_blink(state);
-		msleep(delay);
-		total += delay;
+			 I8042_LED_SCROLLLOCK;
+		reinit_completion(&keydance_bench_done);
+		start = get_cycles();
+		i8042_led_post(state);
+		left = wait_for_completion_killable_timeout(
+				&keydance_bench_done, msecs_to_jiffies(100));
+		if (left <= 0) {
+			error = left ?: -ETIMEDOUT;
+			break;
+		}
+		v[i] = keydance_bench_end - start;
+	}
+	WRITE_ONCE(keydance_bench_led, false);
+	keydance_post_leds(&keydance_main);
+	if (!error && i)
+		keydance_bench_report(keydance_bench_result[0], "led",
+				      "cycles", v, i);
+	return error;
+}
+
+static int keydance_bench_input(u64 *v, unsigned int n)
+{
+#define KEYDANCE_KEY_SCANCODE(scancode, keycode, led)	scancode,
+	static const unsigned char keys[] = {
+		KEYDANCE_KEYMAP(KEYDANCE_KEY_SCANCODE)
+	};
+	struct keydance_session *ks = &keydance_bench_session;
+	struct keydance_snap s = { .running = true }, scored;
+	unsigned long begin = jiffies;
+	unsigned char bit;
+	cycles_t start;
+	unsigned int i;
+
+	for (i = 0; i < n && !keydance_bench_over(begin); i++) {
+		bit = dancekey_led_table[keys[i % ARRAY_SIZE(keys)]];
+		if (i % ARRAY_SIZE(keys) == 0) {
+			s.lock_state = keydance_next_pattern(ks);
+			WRITE_ONCE(ks->pattern_ns, ktime_get_ns());
+			atomic64_set(&ks->state, keydance_pack(&s));
+		}
+		start = get_cycles();
+		keydance_score_key(ks, bit, &scored);
+		v[i] = get_cycles() - start;
+		cond_resched();
+	}
+	atomic64_set(&ks->state, 0);
+	keydance_post_leds(&keydance_main);
+	if (i)
+		keydance_bench_report(keydance_bench_result[1], "input",
+				      "cycles", v, i);
+	return 0;
+}
+
+static void keydance_bench_timerfn(unsigned long unused)
+{
+	keydance_bench_fired_ns = ktime_get_ns();
+	complete(&keydance_bench_done);
+}
+
+static enum hrtimer_restart keydance_bench_hrtimerfn(struct hrtimer *timer)
+{
+	keydance_bench_timerfn(0);
+	return HRTIMER_NORESTART;
+}
+
+/* re-arm a timer one jiffy (or 1ms for hrtimers) ahead, @n times */
+static int keydance_bench_timers(u64 *v, unsigned int n)
+{
+	u64 period = use_hrtimer ? NSEC_PER_MSEC : jiffies_to_nsecs(1);
+	unsigned long begin = jiffies;
+	u64 *delay = v + n;
+	u64 armed;
+	cycles_t start;
+	unsigned int i;
+	int error = 0;
+
+	for (i = 0; i < n && !keydance_bench_over(begin); i++) {
+		reinit_completion(&keydance_bench_done);
+		armed = ktime_get_ns();
+		start = get_cycles();
+		if (use_hrtimer)
+			hrtimer_start(&keydance_bench_hrtimer,
+				      ns_to_ktime(armed + period),
+				      HRTIMER_MODE_ABS);
+		else
+			mod_timer(&keydance_bench_timer, jiffies + 1);
+		v[i] = get_cycles() - start;
+		error = wait_for_completion_killable(&keydance_bench_done);
+		if (error)
+			break;
+		delay[i] = keydance_bench_fired_ns - armed;
+	}
+	if (error) {
+		/* the timer may still fire into the completion */
+		if (use_hrtimer)
+			hrtimer_cancel(&keydance_bench_hrtimer);
+		else
+			del_timer_sync(&keydance_bench_timer);
+		return error;
+	}
+	if (i) {
+		keydance_bench_report(keydance_bench_result[2], "timer arm",
+				      "cycles", v, i);
+		keydance_bench_report(keydance_bench_result[3], "timer fire",
+				      "ns", delay, i);
+	}
+	return 0;
+}
+
+static ssize_t keydance_bench_write(struct file *file, const char __user *buf,
+				    size_t count, loff_t *ppos)
+{
+	struct keydance_session *ks;
+	struct keydance_snap s;
+	char cmd[32], what[16];
+	unsigned int n;
+	u64 *v;
+	int error, i;
+
+	if (count >= sizeof(cmd))
+		return -EINVAL;
+	if (copy_from_user(cmd, buf, count))
+		return -EFAULT;
+	cmd[count] = '\0';
+	error = sscanf(cmd, "%15s %u", what, &n);
+	if (error != 2 || !n || n > KEYDANCE_BENCH_MAX)
+		return -EINVAL;
+	/* room for two sample sets, for the timer benchmark */
+	v = vmalloc(2 * n * sizeof(*v));
+	if (!v)
+		return -ENOMEM;
+
+	error = mutex_lock_killable(&keydance_bench_mutex);
+	if (error)
+		goto out_free;
+	mutex_lock(&keydance_ctl_mutex);
+	keydance_for_each_session(i, ks) {
+		keydance_snapshot(ks, &s);
+		if (s.running)
+			break;
+	}
+	if (i < KEYDANCE_MAX_SESSIONS || keydance_phase != KEYDANCE_UP)
+		error = -EBUSY;
+	else {
+		led_test_cancel();
+		keydance_benching = true;
+	}
+	mutex_unlock(&keydance_ctl_mutex);
+	if (error)
+		goto out_unlock;
+
+	if (!strcmp(what, "led"))
+		error = keydance_bench_leds(v, n);
+	else if (!strcmp(what, "input"))
+		error = keydance_bench_input(v, n);
+	else if (!strcmp(what, "timer"))
+		error = keydance_bench_timers(v, n);
+	else
+		error = -EINVAL;
+
+	mutex_lock(&keydance_ctl_mutex);
+	keydance_benching = false;
+	mutex_unlock(&keydance_ctl_mutex);
+out_unlock:
+	mutex_unlock(&keydance_bench_mutex);
+out_free:
+	vfree(v);
+	return error ? error : count;
+}
+
+static ssize_t keydance_bench_read(struct file *file, char __user *buf,
+				   size_t count, loff_t *ppos)
+{
+	char out[sizeof(keydance_bench_result)];
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(keydance_bench_result); i++)
+		len += scnprintf(out + len, sizeof(out) - len, "%s",
+				 keydance_bench_result[i]);
+	return simple_read_from_buffer(buf, count, ppos, out, len);
+}
+
+static const struct file_operations keydance_bench_fops = {
+	.owner		= THIS_MODULE,
+	.read		= keydance_bench_read,
+	.write		= keydance_bench_write,
+	.llseek		= default_llseek,
+};
+
+static void keydance_bench_init(void)
+{
+	setup_timer(&keydance_bench_timer, keydance_bench_timerfn, 0);
+	hrtimer_init(&keydance_bench_hrtimer, CLOCK_MONOTONIC,
+		     HRTIMER_MODE_ABS);
+	keydance_bench_hrtimer.function = keydance_bench_hrtimerfn;
+	keydance_bench_session.id = KEYDANCE_MAX_SESSIONS;
+	keydance_session_init(&keydance_bench_session, "bench");
+}
+
+/* LED engine callback: @state has reached the keyboard */
+static void keydance_led_done(char state, u64 latency_ns)
+{
+	keydance_hist_add(KEYDANCE_HIST_LED, latency_ns);
+	if (READ_ONCE(keydance_bench_led)) {
+		keydance_bench_end = get_cycles();
+		complete(&keydance_bench_done);
 	}
 }
 
 /* IRQ thread:
- * 1. Get input key and search it in the dancekey scancode table. 
+ * 1. Get input keys queued by the interrupt handler.
  * 2. If it's a match key, clear corresponding bit of lock_state and update 
  *    LED accordingly.
  * 3. If it's a wrong key, count it in extras, which is used by timerfn to 
  *    calculate misses 
  */
+static void keydance_drain_keys(struct keydance_session *ks)
+{
+	struct keydance_key key;
+
+	while (kfifo_get(&ks->keys, &key))
+		keydance_handle_key(ks, key.code, key.bit, key.time_ns);
+}
+
 static irqreturn_t keydance_threadfn(int irq, void *id)
 {
-	/* WRITE YOUR OWN CODE HERE */
+	keydance_drain_keys(id);
 	return IRQ_HANDLED;
 }
 
+/* Queue dance key @code for the irq thread of @ks, if a game is running
+ * there and not paused. @bit is the LED the key answers, 0 for keys that
+ * are not dance keys. Returns whether the key was queued.
+ */
+static bool keydance_queue_key(struct keydance_session *ks,
+			       unsigned char code, unsigned char bit)
+{
+	struct keydance_key key = { .code = code, .bit = bit };
+	struct keydance_snap s;
+
+	keydance_count(interrupts);
+	if (!bit)			/* also filters key release */
+		goto filtered;
+	if (READ_ONCE(keydance_phase) != KEYDANCE_UP)
+		goto filtered;
+	keydance_snapshot(ks, &s);
+	if (!s.running || s.paused)
+		goto filtered;
+	key.time_ns = ktime_get_ns();
+	if (!kfifo_put(&ks->keys, key))
+		goto filtered;	/* thread is behind, drop the key */
+	trace_keydance_scancode(code, true);
+	return true;
+filtered:
+	keydance_count(filtered);
+	trace_keydance_scancode(code, false);
+	return false;
+}
+
 /* interrupt handler: 
- * Only wake up irq thread to do the job.
+ * Read the scancode once and filter it here, so the irq thread is only
+ * woken for dance key presses while a game is running and not paused.
+ * Everything else, including interrupts from other devices sharing the
+ * line, costs one port read and no wakeup.
  */
 static irqreturn_t keydance_interrupt(int irq, void *id)
 {
-	/* WRITE YOUR OWN CODE HERE */
-	return IRQ_WAKE_THREAD;
+	unsigned char scancode = keydance_backend->read_key();
+
+	/* answers to LED bytes; like all bytes from 0x80 up, never a key */
+	if (unlikely(scancode >= I8042_KBD_ACK))
+		i8042_led_reply(scancode);
+	if (keydance_queue_key(id, scancode, dancekey_led_table[scancode]))
+		return IRQ_WAKE_THREAD;
+	return IRQ_NONE;
 }
 
-static int __init keydance_init(void)
+/* Simulated input, /sys/kernel/debug/keydance/inject. Each byte takes the
+ * same path as a real scancode: the interrupt handler's filter, then the
+ * irq thread, of the main session. Injectors are serialized, which keeps
+ * its key queue single producer, single consumer as the real interrupt
+ * would. A tick steps under keydance_ctl_mutex, as start, stop and pause
+ * expect of a step timer they can stop: they never see one mid-step.
+ */
+static DEFINE_MUTEX(keydance_sim_mutex);
+
+static void keydance_inject(unsigned char byte)
 {
-	struct proc_dir_entry *entry;
+	switch (byte) {
+	case KEYDANCE_SIM_TICK:
+		if (sim == KEYDANCE_SIM_MANUAL) {
+			mutex_lock(&keydance_ctl_mutex);
+			keydance_step(&keydance_main);
+			mutex_unlock(&keydance_ctl_mutex);
+		}
+		break;
+	case KEYDANCE_SIM_START:
+		keydance_start();
+		break;
+	default:
+		if (keydance_queue_key(&keydance_main, byte,
+				       dancekey_led_table[byte]))
+			keydance_drain_keys(&keydance_main);
+	}
+}
+
+static ssize_t keydance_inject_write(struct file *file, const char __user *buf,
+				     size_t count, loff_t *ppos)
+{
+	unsigned char batch[256];
+	size_t done, n, i;
+
+	mutex_lock(&keydance_sim_mutex);
+	for (done = 0; done < count; done += n) {
+		n = min(count - done, sizeof(batch));
+		if (copy_from_user(batch, buf + done, n))
+			break;
+		for (i = 0; i < n; i++)
+			keydance_inject(batch[i]);
+		cond_resched();
+	}
+	mutex_unlock(&keydance_sim_mutex);
+	if (!done && count)
+		return -EFAULT;
+	return done;
+}
+
+static const struct file_operations keydance_inject_fops = {
+	.owner		= THIS_MODULE,
+	.write		= keydance_inject_write,
+	.llseek		= no_llseek,
+};
+
+/* i8042 backend: LEDs through the asynchronous LED engine in i8042.h,
+ * keys read from the data port by the keyboard interrupt handler. The sim
+ * backend is the same engine with the port writes replaced by a store to
+ * i8042_led.sink, and no interrupt.
+ */
+static void keydance_i8042_set_leds(struct keydance_session *ks,
+				    unsigned char (*get)(struct keydance_session *ks))
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&i8042_led.lock, flags);
+	__i8042_led_post(get(ks));
+	spin_unlock_irqrestore(&i8042_led.lock, flags);
+}
+
+static unsigned char keydance_i8042_read_key(void)
+{
+	return i8042_read_data();
+}
+
+static void keydance_i8042_led_counts(u64 *posts, u64 *writes)
+{
+	*posts = i8042_led.posts;
+	*writes = i8042_led.writes;
+}
+
+static void keydance_i8042_led_errors(unsigned long *resends,
+				      unsigned long *timeouts,
+				      unsigned long *failures)
+{
+	*resends = READ_ONCE(i8042_led.resends);
+	*timeouts = READ_ONCE(i8042_led.timeouts);
+	*failures = READ_ONCE(i8042_led.failures);
+}
+
+/* Poll IBF at about the time it took to clear, and never step faster than
+ * the slowest write took. */
+static void keydance_i8042_calibrated(void)
+{
+	struct keydance_led_cal *cal = &keydance_led_cal;
+	unsigned long flags;
+
+	spin_lock_irqsave(&i8042_led.lock, flags);
+	i8042_led.calibrate = false;
+	cal->ibf = i8042_led.ibf;
+	cal->ack = i8042_led.ack;
+	cal->rtt = i8042_led.rtt;
+	spin_unlock_irqrestore(&i8042_led.lock, flags);
+	if (!cal->rtt.count)
+		return;
+	if (cal->ibf.count)
+		i8042_led_set_poll(i8042_led_time_avg(&cal->ibf));
+	cal->poll_ns = READ_ONCE(i8042_led.poll_ns);
+	WRITE_ONCE(keydance_step_floor_ns, cal->rtt.max_ns);
+	smp_store_release(&cal->valid, true);
+}
+
+static int keydance_i8042_init(void)
+{
+	i8042_led_init();
+	i8042_led.done = keydance_led_done;
+	i8042_led.calibrate = led_selftest;
+	/* until calibrated: patterns can not change faster than the
+	 * keyboard takes them */
+	if (!i8042_led.sim)
+		keydance_step_floor_ns = max_t(u64, KEYDANCE_STEP_FLOOR_NS,
+				(i8042_led_blink(0) + 1) * NSEC_PER_MSEC);
+	return 0;
+}
+
+static int keydance_sim_init(void)
+{
+	i8042_led.sim = true;
+	return keydance_i8042_init();
+}
+
+static void keydance_i8042_exit(void)
+{
+	i8042_led_blink(0);
+	i8042_led_exit();
+}
+
+static const struct keydance_backend keydance_i8042_backend = {
+	.name		= "i8042",
+	.init		= keydance_i8042_init,
+	.exit		= keydance_i8042_exit,
+	.set_leds	= keydance_i8042_set_leds,
+	.read_key	= keydance_i8042_read_key,
+	.led_counts	= keydance_i8042_led_counts,
+	.led_errors	= keydance_i8042_led_errors,
+	.calibrated	= keydance_i8042_calibrated,
+	.led_done	= true,
+};
+
+static const struct keydance_backend keydance_sim_backend = {
+	.name		= "sim",
+	.init		= keydance_sim_init,
+	.exit		= keydance_i8042_exit,
+	.set_leds	= keydance_i8042_set_leds,
+	.led_counts	= keydance_i8042_led_counts,
+	.calibrated	= keydance_i8042_calibrated,
+	.led_done	= true,
+};
+
+/* input backend: an input handler bound to every keyboard with LEDs, so
+ * USB HID and other non-i8042 keyboards can play too, each keyboard in a
+ * session of its own. LED states are injected as EV_LED events and the
+ * drivers send them on; there is no completion, so the LED histogram and
+ * benchmark stay empty. Key presses arrive in the event handler under the
+ * device's event lock and are queued for the session's work item, which
+ * plays the irq thread. A session's led_lock orders its LED updates; it is
+ * never taken inside an event handler, which could deadlock on injecting.
+ *
+ * With capture=input the handler is also used on its own, for keys only,
+ * next to the i8042 LED engine: keys from all keyboards then go to the
+ * main session, decoded by atkbd instead of read from the data port a
+ * second time in a shared IRQ 1 handler.
+ */
+static bool keydance_input_leds;	/* one session per keyboard */
+
+static void keydance_input_work_fn(struct work_struct *work)
+{
+	keydance_drain_keys(container_of(work, struct keydance_session,
+					 key_work));
+}
+
+static void keydance_input_show(struct input_handle *handle, char state)
+{
+	input_inject_event(handle, EV_LED, LED_NUML,
+			   !!(state & I8042_LED_NUMLOCK));
+	input_inject_event(handle, EV_LED, LED_CAPSL,
+			   !!(state & I8042_LED_CAPSLOCK));
+	input_inject_event(handle, EV_LED, LED_SCROLLL,
+			   !!(state & I8042_LED_SCROLLLOCK));
+	input_inject_event(handle, EV_SYN, SYN_REPORT, 0);
+}
+
+static void keydance_input_set_leds(struct keydance_session *ks,
+				    unsigned char (*get)(struct keydance_session *ks))
+{
+	unsigned char state;
+	unsigned long flags;
+
+	spin_lock_irqsave(&ks->led_lock, flags);
+	state = get(ks);
+	ks->led_posts++;
+	if (state != ks->led_state) {
+		ks->led_state = state;
+		ks->led_writes++;
+		if (ks->handle)
+			keydance_input_show(ks->handle, state);
+	}
+	spin_unlock_irqrestore(&ks->led_lock, flags);
+}
+
+static void keydance_input_led_counts(u64 *posts, u64 *writes)
+{
+	struct keydance_session *ks;
+	int i;
+
+	*posts = *writes = 0;
+	rcu_read_lock();
+	keydance_for_each_session(i, ks) {
+		*posts += ks->led_posts;
+		*writes += ks->led_writes;
+	}
+	rcu_read_unlock();
+}
+
+static void keydance_input_event(struct input_handle *handle,
+				 unsigned int type, unsigned int code,
+				 int value)
+{
+	struct keydance_session *ks = handle->private;
+	bool queued;
+
+	if (type != EV_KEY || value != 1)	/* presses only */
+		return;
+	spin_lock(&ks->key_lock);
+	queued = keydance_queue_key(ks, code, code < 256 ?
+				    dancekey_keycode_table[code] : 0);
+	spin_unlock(&ks->key_lock);
+	if (queued)
+		schedule_work(&ks->key_work);
+}
+
+static int keydance_input_connect(struct input_handler *handler,
+				  struct input_dev *dev,
+				  const struct input_device_id *id)
+{
+	struct keydance_session *ks = &keydance_main;
+	struct input_handle *handle;
 	int error;
 
-	led_test();
-	spin_lock_init(&keydance_lock);
-	error = request_threaded_irq(I8042_KBD_IRQ, keydance_interrupt,
-				keydance_threadfn, IRQF_SHARED, "keydance", 
-				&lock_state);
+	handle = kzalloc(sizeof(*handle), GFP_KERNEL);
+	if (!handle)
+		return -ENOMEM;
+	if (keydance_input_leds) {
+		ks = kzalloc(sizeof(*ks), GFP_KERNEL);
+		if (!ks) {
+			error = -ENOMEM;
+			goto fail0;
+		}
+		keydance_session_init(ks, dev->name ?: "keyboard");
+		INIT_WORK(&ks->key_work, keydance_input_work_fn);
+		ks->handle = handle;
+	}
+	handle->dev = dev;
+	handle->handler = handler;
+	handle->name = "keydance";
+	handle->private = ks;
+	error = input_register_handle(handle);
+	if (error)
+		goto fail1;
+	error = input_open_device(handle);
 	if (error)
+		goto fail2;
+	if (ks != &keydance_main) {
+		keydance_input_show(handle, 0);
+		mutex_lock(&keydance_ctl_mutex);
+		error = keydance_session_add(ks);
+		mutex_unlock(&keydance_ctl_mutex);
+		if (error)
+			goto fail3;
+	}
+	return 0;
+fail3:
+	input_close_device(handle);
+fail2:
+	input_unregister_handle(handle);
+fail1:
+	if (ks != &keydance_main)
+		kfree(ks);
+fail0:
+	kfree(handle);
+	return error;
+}
+
+static void keydance_input_disconnect(struct input_handle *handle)
+{
+	struct keydance_session *ks = handle->private;
+
+	if (ks != &keydance_main) {
+		mutex_lock(&keydance_ctl_mutex);
+		keydance_session_del(ks);
+		keydance_stats_publish();
+		mutex_unlock(&keydance_ctl_mutex);
+		synchronize_rcu();	/* for LED posts from the self-test */
+	}
+	input_close_device(handle);
+	if (ks != &keydance_main) {
+		cancel_work_sync(&ks->key_work);
+		kfree(ks);
+	}
+	input_unregister_handle(handle);
+	kfree(handle);
+}
+
+static const struct input_device_id keydance_input_ids[] = {
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT,
+		.evbit = { BIT_MASK(EV_KEY) | BIT_MASK(EV_LED) },
+	},
+	{ },
+};
+
+static struct input_handler keydance_input_handler = {
+	.event		= keydance_input_event,
+	.connect	= keydance_input_connect,
+	.disconnect	= keydance_input_disconnect,
+	.name		= "keydance",
+	.id_table	= keydance_input_ids,
+};
+
+static int keydance_input_register(bool leds)
+{
+	keydance_input_leds = leds;
+	if (!leds)
+		INIT_WORK(&keydance_main.key_work, keydance_input_work_fn);
+	return input_register_handler(&keydance_input_handler);
+}
+
+static void keydance_input_unregister(void)
+{
+	input_unregister_handler(&keydance_input_handler);
+	if (!keydance_input_leds)
+		cancel_work_sync(&keydance_main.key_work);
+}
+
+static int keydance_input_init(void)
+{
+	return keydance_input_register(true);
+}
+
+static void keydance_input_exit(void)
+{
+	struct keydance_session *ks;
+	int i;
+
+	rcu_read_lock();
+	keydance_for_each_session(i, ks)
+		keydance_input_set_leds(ks, keydance_no_leds);
+	rcu_read_unlock();
+	keydance_input_unregister();
+}
+
+static const struct keydance_backend keydance_input_backend = {
+	.name		= "input",
+	.init		= keydance_input_init,
+	.exit		= keydance_input_exit,
+	.set_leds	= keydance_input_set_leds,
+	.led_counts	= keydance_input_led_counts,
+	.per_device	= true,
+};
+
+static const struct keydance_backend *keydance_backends[] = {
+	&keydance_i8042_backend,
+	&keydance_input_backend,
+};
+
+static const struct keydance_backend *keydance_find_backend(void)
+{
+	int i;
+
+	if (sim)
+		return &keydance_sim_backend;
+	for (i = 0; i < ARRAY_SIZE(keydance_backends); i++)
+		if (sysfs_streq(backend, keydance_backends[i]->name))
+			return keydance_backends[i];
+	return NULL;
+}
+
+/* Key capture for backends that can read keys in the keyboard interrupt:
+ * capture=irq (default) reads scancodes from the i8042 data port in a
+ * shared IRQ 1 handler, capture=input takes key presses from the input
+ * handler above instead. Other backends deliver keys themselves.
+ */
+static char *capture = "irq";
+module_param(capture, charp, S_IRUGO);
+MODULE_PARM_DESC(capture, "Key capture with backend=i8042: irq (default) or input");
+
+static bool keydance_capture_irq;	/* shared IRQ 1 handler requested */
+static bool keydance_capture_input;	/* key only input handler registered */
+
+static int keydance_capture_init(void)
+{
+	if (sysfs_streq(capture, "input"))
+		keydance_capture_input = keydance_backend->read_key;
+	else if (sysfs_streq(capture, "irq"))
+		keydance_capture_irq = keydance_backend->read_key;
+	else {
+		pr_err("keydance: unknown capture '%s'\n", capture);
+		return -EINVAL;
+	}
+	if (keydance_capture_irq) {
+		int error = request_threaded_irq(I8042_KBD_IRQ,
+					keydance_interrupt, keydance_threadfn,
+					IRQF_SHARED, "keydance", &keydance_main);
+
+		if (!error)
+			i8042_led_set_ack_irq(true);
 		return error;
+	}
+	if (keydance_capture_input)
+		return keydance_input_register(false);
+	return 0;
+}
+
+static void keydance_capture_exit(void)
+{
+	if (keydance_capture_irq) {
+		/* no game runs, so this only waits for the handler and
+		   thread already running */
+		i8042_led_set_ack_irq(false);
+		synchronize_irq(I8042_KBD_IRQ);
+		free_irq(I8042_KBD_IRQ, &keydance_main);
+	}
+	if (keydance_capture_input)
+		keydance_input_unregister();
+}
+
+static int __init keydance_init(void)
+{
+	struct proc_dir_entry *entry;
+	int error = 0;
+
+	KEYDANCE_KEYMAP(KEYDANCE_KEY_CHECK)
+	BUILD_BUG_ON(KEYDANCE_SAVE_SESSIONS != KEYDANCE_MAX_SESSIONS);
+	BUILD_BUG_ON(KEYDANCE_SAVE_HISTS != KEYDANCE_NHISTS);
+	BUILD_BUG_ON(KEYDANCE_SAVE_BUCKETS != KEYDANCE_HIST_BUCKETS);
+	keydance_backend = keydance_find_backend();
+	if (!keydance_backend) {
+		pr_err("keydance: unknown backend '%s'\n", backend);
+		keydance_curve_release();	/* curve= may have set one */
+		return -EINVAL;
+	}
+	if (!rcu_access_pointer(keydance_curve) && keydance_curve_default()) {
+		keydance_curve_release();
+		return -ENOMEM;
+	}
+	keydance_hists = __alloc_percpu(sizeof(struct keydance_hist) *
+					KEYDANCE_NHISTS,
+					__alignof__(struct keydance_hist));
+	if (!keydance_hists) {
+		keydance_curve_release();
+		return -ENOMEM;
+	}
+	keydance_stats_page = (void *)get_zeroed_page(GFP_KERNEL);
+	if (!keydance_stats_page) {
+		free_percpu(keydance_hists);
+		keydance_curve_release();
+		return -ENOMEM;
+	}
+	keydance_stats_page->version = KEYDANCE_STATS_VERSION;
+	keydance_events_init();
+	keydance_session_init(&keydance_main, "main");
+	if (!keydance_backend->per_device) {
+		error = keydance_session_add(&keydance_main);
+		if (error)
+			goto fail0;
+	}
+	error = keydance_backend->init();
+	if (error)
+		goto fail0;
+	keydance_stats_publish();
+	error = keydance_capture_init();
+	if (error)
+		goto fail1;
+	error = -ENOMEM;
 	entry = proc_create(keydance_start_fname, S_IWUGO, NULL, \
 			    &keydance_start_proc_fops);
 	if (IS_ERR_OR_NULL(entry))
-		goto fail1;
+		goto fail2;
 	entry = proc_create(keydance_result_fname, S_IRUGO, NULL, \
                             &keydance_result_proc_fops);
 	if (IS_ERR_OR_NULL(entry))
-		goto fail2;
-
-	init_timer(&keydance_timer);
-	keydance_timer.function = keydance_timerfn;
+		goto fail3;
+	error = misc_register(&keydance_stats_dev);
+	if (error)
+		goto fail4;
+	error = misc_register(&keydance_events_dev);
+	if (error)
+		goto fail5;
+	error = misc_register(&keydance_log_dev);
+	if (error)
+		goto fail6;
+	error = misc_register(&keydance_save_dev);
+	if (error)
+		goto fail7;
+	keydance_bench_init();
+	/* debugfs is optional, keep going without it */
+	keydance_debugfs = debugfs_create_dir("keydance", NULL);
+	if (!IS_ERR_OR_NULL(keydance_debugfs)) {
+		debugfs_create_file("bench", S_IRUSR | S_IWUSR,
+				    keydance_debugfs, NULL,
+				    &keydance_bench_fops);
+		if (sim) {
+			debugfs_create_file("inject", S_IWUSR,
+					    keydance_debugfs, NULL,
+					    &keydance_inject_fops);
+			debugfs_create_u32("leds", S_IRUSR, keydance_debugfs,
+					   &i8042_led.sink);
+		}
+	}
+	if (led_selftest)
+		schedule_delayed_work(&led_test_work, 0);
 	return 0;
-fail2:
+fail7:
+	misc_deregister(&keydance_log_dev);
+fail6:
+	misc_deregister(&keydance_events_dev);
+fail5:
+	misc_deregister(&keydance_stats_dev);
+fail4:
+	remove_proc_entry(keydance_result_fname, NULL);
+	keydance_result_exit();
+fail3:
 	remove_proc_entry(keydance_start_fname, NULL);
+fail2:
+	keydance_capture_exit();
 fail1:
-	return -ENOMEM;
+	keydance_backend->exit();
+fail0:
+	keydance_step_thread_stop(&keydance_main);
+	free_page((unsigned long)keydance_stats_page);
+	free_percpu(keydance_hists);
+	keydance_curve_release();
+	return error;
 }
 
+/* Teardown runs in bounded time and never waits for a game to end:
+ * 1. KEYDANCE_STOPPING: from here on no game starts, no step timer is
+ *    armed, even by a timer already running, and keys are dropped in the
+ *    interrupt handler.
+ * 2. Stop every game, its timer and its step thread; they can not re-arm
+ *    any more.
+ * 3. Quiesce the key path: wait for the interrupt handler and irq thread
+ *    (or the input handler and its work) that may still run, and release
+ *    them.
+ * 4. Drain the LED backend: queued writes finish, the LEDs go off.
+ * 5. Only then remove the user interfaces, wait for the adaptive step
+ *    work they and the timers may have queued, and free the memory.
+ */
 static void __exit keydance_exit(void)
 {
-	/* CAUTION: Undo in the right order and note possible race conditions!
-                    May need to wait for a game to end */
-	game_running = false;
-	del_timer_sync(&keydance_timer);
-	i8042_led_blink(0);
+	struct keydance_session *ks;
+	int i;
+
+	debugfs_remove_recursive(keydance_debugfs);
+	/* wait out a benchmark still running, at most KEYDANCE_BENCH_TIME */
+	mutex_lock(&keydance_bench_mutex);
+	mutex_unlock(&keydance_bench_mutex);
+	cancel_work_sync(&keydance_bench_session.pattern_work);
+	mutex_lock(&keydance_ctl_mutex);
+	WRITE_ONCE(keydance_phase, KEYDANCE_STOPPING);
+	led_test_cancel();
+	keydance_for_each_session(i, ks) {
+		keydance_session_stop(ks);
+		keydance_step_thread_stop(ks);
+	}
+	keydance_stats_publish();
+	mutex_unlock(&keydance_ctl_mutex);
+	keydance_capture_exit();
+	keydance_backend->exit();
+	misc_deregister(&keydance_save_dev);
+	misc_deregister(&keydance_log_dev);
+	misc_deregister(&keydance_events_dev);
+	misc_deregister(&keydance_stats_dev);
 	remove_proc_entry(keydance_result_fname, NULL);
+	keydance_result_exit();
 	remove_proc_entry(keydance_start_fname, NULL);
-	free_irq(I8042_KBD_IRQ, &lock_state);
+	cancel_work_sync(&keydance_adaptive_work);
+	free_page((unsigned long)keydance_stats_page);
+	free_percpu(keydance_hists);
+	keydance_curve_release();
 }
 
 MODULE_LICENSE ("GPL");
@@ -0,0 +1,167 @@
+/*
+ * Key dancing binary interfaces, shared with userspace
+ *
+ * /dev/keydance-stats: a read-only page holding struct keydance_stats.
+ * mmap() it once and read it at any rate, no syscalls needed. The kernel
+ * bumps seq to an odd value before changing the page and to the next even
+ * value after, so a consistent copy is taken like this:
+ *
+ *	do {
+ *		seq = stats->seq;	(retry while odd)
+ *		barrier();
+ *		copy = *stats;
+ *		barrier();
+ *	} while (seq & 1 || stats->seq != seq);
+ *
+ * read() on the device returns the same structure, already consistent.
+ *
+ * /dev/keydance-events: a stream of struct keydance_event. read() blocks
+ * until at least one event is available (unless O_NONBLOCK) and returns
+ * as many whole events as fit in the buffer; poll()/epoll() report
+ * POLLIN when there is something to read. Each open file has its own read
+ * position and starts at the next new event. Events are numbered by seq;
+ * a gap means the reader fell behind and events were overwritten.
+ *
+ * With backend=input every keyboard plays its own game. All of them share
+ * the event stream, tagged with the session id, and the stats page shows
+ * the game of session 0.
+ *
+ * /dev/keydance-save: opening it for reading takes a struct keydance_save
+ * of the games, the counters and the histograms; writing one back through
+ * one open file puts them back and resumes the running games with a fresh
+ * step; paused games stay paused. It is meant for reloading the module in
+ * the middle of a session: save, rmmod, insmod, restore.
+ *
+ * /dev/keydance-log holds the recent games as struct keydance_log_record,
+ * one per step: the pattern shown, the LEDs answered, the wrong keys and
+ * the outcome, timed from the session's previous record. An open file
+ * starts at the oldest record kept and read() returns as many whole
+ * records as fit, blocking (or poll()ing) for more; splice() works too.
+ * If the reader falls behind, a KEYDANCE_LOG_LOST record says how many
+ * records were overwritten.
+ *
+ * In simulation mode (sim=1 or sim=2) the keyboard is not used. Bytes
+ * written to /sys/kernel/debug/keydance/inject are fed one by one through
+ * the interrupt handler and irq thread as scancodes, except for the two
+ * control bytes below. The LEDs can be read back from .../keydance/leds.
+ */
+
+#ifndef _KEYDANCE_H
+#define _KEYDANCE_H
+
+#include <linux/types.h>
+
+#define KEYDANCE_SIM_TICK	0x00	/* sim=2: run one step now */
+#define KEYDANCE_SIM_START	0xff	/* start a new game */
+
+#define KEYDANCE_STATS_VERSION	2
+
+struct keydance_stats {
+	__u32 version;		/* KEYDANCE_STATS_VERSION */
+	__u32 seq;		/* odd while being updated */
+	__u32 running;		/* 1 if a game is running */
+	__u32 level;
+	__u32 hits;
+	__u32 misses;
+	__u64 step_time_ns;	/* step time of the current level */
+	__u64 led_posts;	/* LED updates requested */
+	__u64 led_writes;	/* LED updates sent to the keyboard */
+	__u64 update_ns;	/* CLOCK_MONOTONIC time of this update */
+	/* since version 2: counters since the module was loaded */
+	__u64 total_interrupts;	/* keyboard interrupts seen */
+	__u64 total_filtered;	/* ... that needed no game work */
+	__u64 total_keys;	/* matching dance keys */
+	__u64 total_wrong_keys;	/* dance keys whose LED was off */
+	__u64 total_hits;
+	__u64 total_misses;
+	__u64 total_patterns;
+	__u64 total_games;
+};
+
+enum keydance_event_type {
+	KEYDANCE_EV_START = 1,	/* game started */
+	KEYDANCE_EV_PATTERN,	/* new LED pattern shown */
+	KEYDANCE_EV_KEY,	/* matching key pressed */
+	KEYDANCE_EV_WRONG_KEY,	/* key pressed whose LED is off */
+	KEYDANCE_EV_HIT,	/* pattern answered correctly */
+	KEYDANCE_EV_MISS,	/* pattern missed */
+	KEYDANCE_EV_LEVEL,	/* level up */
+	KEYDANCE_EV_GAME_OVER,	/* game stopped */
+	KEYDANCE_EV_PAUSE,	/* game paused */
+	KEYDANCE_EV_RESUME,	/* game resumed */
+};
+
+struct keydance_event {
+	__u64 time_ns;		/* CLOCK_MONOTONIC */
+	__u32 seq;		/* event number */
+	__u8 type;		/* enum keydance_event_type */
+	__u8 pattern;		/* LED pattern, what is left of it for keys */
+	__u8 key;		/* LED bit of the key pressed */
+	__u8 level;
+	__u16 hits;
+	__u16 misses;
+	__u16 session;		/* game session, 0 unless one per keyboard */
+	__u16 reserved;
+};
+
+enum keydance_log_type {
+	KEYDANCE_LOG_START = 1,	/* game started, delta_us is 0 */
+	KEYDANCE_LOG_HIT,	/* pattern answered in time */
+	KEYDANCE_LOG_MISS,	/* pattern not answered, or wrong keys */
+	KEYDANCE_LOG_STOP,	/* game stopped by a command */
+	KEYDANCE_LOG_PAUSE,	/* game paused */
+	KEYDANCE_LOG_RESUME,	/* game resumed, delta_us is the pause */
+	KEYDANCE_LOG_LOST,	/* delta_us records were overwritten */
+};
+
+#define KEYDANCE_LOG_TYPE	0x0f	/* outcome: enum keydance_log_type */
+#define KEYDANCE_LOG_LEVEL	0x10	/* ... and the level went up */
+#define KEYDANCE_LOG_OVER	0x20	/* ... and the game ended */
+#define KEYDANCE_LOG_LAP	0x80	/* used by the ring, never read */
+
+struct keydance_log_record {
+	__u32 delta_us;		/* since the session's previous record */
+	__u8 session;
+	__u8 outcome;		/* type and flags, see above */
+	__u8 leds;		/* pattern shown (bits 0-3), answered (4-7) */
+	__u8 wrong;		/* wrong keys pressed, saturating */
+};
+
+#define KEYDANCE_SAVE_MAGIC	0x4e53444b	/* "KDSN" */
+#define KEYDANCE_SAVE_VERSION	1
+#define KEYDANCE_SAVE_SESSIONS	32
+#define KEYDANCE_SAVE_HISTS	20
+#define KEYDANCE_SAVE_BUCKETS	176
+
+struct keydance_save_session {
+	__u8 valid;		/* a session had this id */
+	__u8 running;
+	__u8 lock_state;	/* pattern left to answer */
+	__u8 extras;		/* wrong keys in this step */
+	__u8 level;
+	__u8 paused;		/* running, but paused */
+	__u16 hits;
+	__u16 misses;
+	__u16 reserved2[3];
+};
+
+struct keydance_save_hist {
+	__u64 max_ns;
+	__u32 count[KEYDANCE_SAVE_BUCKETS];
+};
+
+struct keydance_save {
+	__u32 magic;		/* KEYDANCE_SAVE_MAGIC */
+	__u16 version;		/* KEYDANCE_SAVE_VERSION */
+	__u16 reserved;
+	__u32 size;		/* sizeof(struct keydance_save) */
+	__u32 reserved2;
+	__u64 time_ns;		/* CLOCK_MONOTONIC time of the save */
+	/* the totals of struct keydance_stats, in the same order */
+	__u64 totals[8];
+	struct keydance_save_session sessions[KEYDANCE_SAVE_SESSIONS];
+	/* key, level and LED latency, as in /proc/keydance-result */
+	struct keydance_save_hist hists[KEYDANCE_SAVE_HISTS];
+};
+
+#endif /* _KEYDANCE_H */
@@ -0,0 +1,129 @@
+/*
+ * Key dancing tracepoints
+ *
+ * Enable them with perf or ftrace, e.g.
+ *	echo 1 > /sys/kernel/debug/tracing/events/keydance/enable
+ * Tracepoints are patched in through static keys, so while disabled they
+ * cost a no-op on the hot paths and their arguments are not computed.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM keydance
+
+#if !defined(_KEYDANCE_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _KEYDANCE_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* every interrupt seen by the hard handler */
+TRACE_EVENT(keydance_scancode,
+	TP_PROTO(unsigned char scancode, bool queued),
+	TP_ARGS(scancode, queued),
+	TP_STRUCT__entry(
+		__field(unsigned char, scancode)
+		__field(bool, queued)
+	),
+	TP_fast_assign(
+		__entry->scancode = scancode;
+		__entry->queued = queued;
+	),
+	TP_printk("scancode=%02x queued=%d", __entry->scancode, __entry->queued)
+);
+
+/* a dance key applied to the game state */
+TRACE_EVENT(keydance_key,
+	TP_PROTO(unsigned char scancode, unsigned char bit, bool hit,
+		 unsigned char left, u64 latency_ns),
+	TP_ARGS(scancode, bit, hit, left, latency_ns),
+	TP_STRUCT__entry(
+		__field(unsigned char, scancode)
+		__field(unsigned char, bit)
+		__field(bool, hit)
+		__field(unsigned char, left)
+		__field(u64, latency_ns)
+	),
+	TP_fast_assign(
+		__entry->scancode = scancode;
+		__entry->bit = bit;
+		__entry->hit = hit;
+		__entry->left = left;
+		__entry->latency_ns = latency_ns;
+	),
+	TP_printk("scancode=%02x led=%x hit=%d left=%x latency=%llu ns",
+		  __entry->scancode, __entry->bit, __entry->hit, __entry->left,
+		  __entry->latency_ns)
+);
+
+/* a new pattern shown by the step timer */
+TRACE_EVENT(keydance_pattern,
+	TP_PROTO(unsigned char pattern, unsigned int level, unsigned int hits,
+		 unsigned int misses),
+	TP_ARGS(pattern, level, hits, misses),
+	TP_STRUCT__entry(
+		__field(unsigned char, pattern)
+		__field(unsigned int, level)
+		__field(unsigned int, hits)
+		__field(unsigned int, misses)
+	),
+	TP_fast_assign(
+		__entry->pattern = pattern;
+		__entry->level = level;
+		__entry->hits = hits;
+		__entry->misses = misses;
+	),
+	TP_printk("pattern=%x level=%u hits=%u misses=%u", __entry->pattern,
+		  __entry->level, __entry->hits, __entry->misses)
+);
+
+/* how late the step timer ran against its absolute expiry */
+TRACE_EVENT(keydance_timer_drift,
+	TP_PROTO(s64 drift_ns),
+	TP_ARGS(drift_ns),
+	TP_STRUCT__entry(
+		__field(s64, drift_ns)
+	),
+	TP_fast_assign(
+		__entry->drift_ns = drift_ns;
+	),
+	TP_printk("drift=%lld ns", __entry->drift_ns)
+);
+
+/* the LED engine starts sending a state */
+TRACE_EVENT(keydance_led_write_start,
+	TP_PROTO(unsigned char state),
+	TP_ARGS(state),
+	TP_STRUCT__entry(
+		__field(unsigned char, state)
+	),
+	TP_fast_assign(
+		__entry->state = state;
+	),
+	TP_printk("state=%x", __entry->state)
+);
+
+/* ... and is done, after @polls IBF polls */
+TRACE_EVENT(keydance_led_write_finish,
+	TP_PROTO(unsigned char state, int polls, u64 latency_ns),
+	TP_ARGS(state, polls, latency_ns),
+	TP_STRUCT__entry(
+		__field(unsigned char, state)
+		__field(int, polls)
+		__field(u64, latency_ns)
+	),
+	TP_fast_assign(
+		__entry->state = state;
+		__entry->polls = polls;
+		__entry->latency_ns = latency_ns;
+	),
+	TP_printk("state=%x polls=%d latency=%llu ns", __entry->state,
+		  __entry->polls, __entry->latency_ns)
+);
+
+#endif /* _KEYDANCE_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE keydance_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,371 @@
+/*
+ * keydance-load: load generator and stats consumer for the keydance module
+ *
+ * Plays the game through the simulation interface (load the module with
+ * sim=1, or sim=2 to step on injected ticks too) at a fixed key rate,
+ * answering the patterns it sees in /dev/keydance-events, and reports
+ * what the input path did:
+ *	- keys injected and events read per second
+ *	- events lost, from gaps in the event seq
+ *	- cost of an injected key, i.e. its trip through the interrupt filter
+ *	  and the irq thread, from the write() time
+ *	- delay from an event being stored to userspace reading it
+ *	- reaction time of the player, pattern shown to key taken
+ *	- LED update latency, from the kernel histograms (needs root)
+ *
+ * Usage: keydance-load [-r keys/s] [-t ticks/s] [-d seconds] [-q]
+ *
+ * With -q only the summary is printed, one field per line, so two runs
+ * can be compared with diff.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../keydance.h"
+
+#define INJECT_PATH	"/sys/kernel/debug/keydance/inject"
+#define STATS_PATH	"/dev/keydance-stats"
+#define EVENTS_PATH	"/dev/keydance-events"
+#define SAVE_PATH	"/dev/keydance-save"
+
+/* scancodes of the dance keys, by LED bit, see KEYDANCE_KEYMAP */
+#define SCAN_SCROLLLOCK	0x04
+#define SCAN_NUMLOCK	0x02
+#define SCAN_CAPSLOCK	0x03
+#define SCAN_OTHER	0x1e	/* 'a', filtered in the interrupt handler */
+
+#define HIST_SUB_BITS	3
+#define HIST_SUB	(1 << HIST_SUB_BITS)
+#define HIST_LED	(KEYDANCE_SAVE_HISTS - 1)
+
+struct samples {
+	uint64_t *v;
+	size_t n, size;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void samples_add(struct samples *s, uint64_t v)
+{
+	if (s->n == s->size) {
+		s->size = s->size ? s->size * 2 : 4096;
+		s->v = realloc(s->v, s->size * sizeof(*s->v));
+		if (!s->v) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	s->v[s->n++] = v;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t samples_pct(const struct samples *s, unsigned int pct)
+{
+	size_t i;
+
+	if (!s->n)
+		return 0;
+	i = (s->n * pct + 99) / 100;
+	return s->v[i ? i - 1 : 0];
+}
+
+static void report_samples(const char *name, struct samples *s)
+{
+	qsort(s->v, s->n, sizeof(*s->v), cmp_u64);
+	printf("%-16s %10zu %10.1f %10.1f %10.1f %10.1f\n", name, s->n,
+	       samples_pct(s, 50) / 1e3, samples_pct(s, 90) / 1e3,
+	       samples_pct(s, 99) / 1e3,
+	       s->n ? s->v[s->n - 1] / 1e3 : 0.0);
+}
+
+/* lowest value in us above histogram bucket @b, as in the module */
+static uint64_t hist_limit(unsigned int b)
+{
+	b++;
+	if (b < HIST_SUB)
+		return b;
+	return (uint64_t)(HIST_SUB + b % HIST_SUB) << (b / HIST_SUB - 1);
+}
+
+/* @pct percentile in us of the difference of two saved histograms */
+static uint64_t hist_pct(const struct keydance_save_hist *a,
+			 const struct keydance_save_hist *b, uint64_t total,
+			 unsigned int pct)
+{
+	uint64_t want = (total * pct + 99) / 100, seen = 0;
+	unsigned int i;
+
+	for (i = 0; i < KEYDANCE_SAVE_BUCKETS; i++) {
+		seen += b->count[i] - a->count[i];
+		if (seen >= want)
+			return hist_limit(i) - 1;
+	}
+	return b->max_ns / 1000;
+}
+
+static int save_read(struct keydance_save *sv)
+{
+	ssize_t n;
+	int fd;
+
+	fd = open(SAVE_PATH, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	n = pread(fd, sv, sizeof(*sv), 0);
+	close(fd);
+	if (n != sizeof(*sv) || sv->magic != KEYDANCE_SAVE_MAGIC ||
+	    sv->version != KEYDANCE_SAVE_VERSION)
+		return -1;
+	return 0;
+}
+
+static void stats_copy(const volatile struct keydance_stats *page,
+		       struct keydance_stats *copy)
+{
+	uint32_t seq;
+
+	do {
+		seq = page->seq;
+		__sync_synchronize();
+		memcpy(copy, (const void *)page, sizeof(*copy));
+		__sync_synchronize();
+	} while (seq & 1 || page->seq != seq);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-r keys/s] [-t ticks/s] [-d seconds] [-q]\n"
+		"  -r  keys injected per second (default 1000)\n"
+		"  -t  step ticks injected per second, for sim=2 (default 0)\n"
+		"  -d  run time in seconds (default 10)\n"
+		"  -q  summary only\n", prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	static const unsigned char scan[8] = {
+		[1] = SCAN_SCROLLLOCK, [2] = SCAN_NUMLOCK, [4] = SCAN_CAPSLOCK,
+	};
+	struct samples inject = { 0 }, delivery = { 0 }, reaction = { 0 };
+	struct keydance_event evs[256];
+	struct keydance_stats before, after;
+	struct keydance_save *sv0, *sv1;
+	unsigned long keys = 0, ticks = 0, events = 0, lost = 0, games = 0;
+	double rate = 1000, tick_rate = 0, seconds = 10;
+	uint64_t start, end, next_key, next_tick, pattern_ns = 0, t, t0;
+	uint64_t led_total = 0;
+	const volatile struct keydance_stats *page;
+	int inject_fd, events_fd, stats_fd, quiet = 0, have_save, opt;
+	unsigned char pending = 0, byte;
+	uint32_t seq = 0;
+	int seq_valid = 0;
+	struct pollfd pfd;
+	ssize_t n;
+	int i, timeout;
+
+	while ((opt = getopt(argc, argv, "r:t:d:q")) != -1) {
+		switch (opt) {
+		case 'r':
+			rate = atof(optarg);
+			break;
+		case 't':
+			tick_rate = atof(optarg);
+			break;
+		case 'd':
+			seconds = atof(optarg);
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (rate <= 0 || tick_rate < 0 || seconds <= 0)
+		usage(argv[0]);
+
+	inject_fd = open(INJECT_PATH, O_WRONLY);
+	if (inject_fd < 0) {
+		perror(INJECT_PATH " (is keydance loaded with sim=1?)");
+		return 1;
+	}
+	events_fd = open(EVENTS_PATH, O_RDONLY | O_NONBLOCK);
+	if (events_fd < 0) {
+		perror(EVENTS_PATH);
+		return 1;
+	}
+	stats_fd = open(STATS_PATH, O_RDONLY);
+	if (stats_fd < 0) {
+		perror(STATS_PATH);
+		return 1;
+	}
+	page = mmap(NULL, sizeof(struct keydance_stats), PROT_READ, MAP_SHARED,
+		    stats_fd, 0);
+	if (page == MAP_FAILED) {
+		perror("mmap " STATS_PATH);
+		return 1;
+	}
+	if (page->version < KEYDANCE_STATS_VERSION) {
+		fprintf(stderr, "stats version %u, need %u\n", page->version,
+			KEYDANCE_STATS_VERSION);
+		return 1;
+	}
+	sv0 = malloc(sizeof(*sv0));
+	sv1 = malloc(sizeof(*sv1));
+	if (!sv0 || !sv1) {
+		perror("malloc");
+		return 1;
+	}
+	have_save = !save_read(sv0);
+	if (!have_save && !quiet)
+		fprintf(stderr, "no %s, LED latency not reported\n", SAVE_PATH);
+
+	stats_copy(page, &before);
+	byte = KEYDANCE_SIM_START;
+	if (write(inject_fd, &byte, 1) != 1) {
+		perror("start");
+		return 1;
+	}
+	games++;
+	start = now_ns();
+	end = start + (uint64_t)(seconds * 1e9);
+	next_key = start;
+	next_tick = tick_rate ? start : UINT64_MAX;
+
+	while ((t = now_ns()) < end) {
+		/* inject what is due */
+		if (t >= next_tick) {
+			byte = KEYDANCE_SIM_TICK;
+			if (write(inject_fd, &byte, 1) == 1)
+				ticks++;
+			next_tick += (uint64_t)(1e9 / tick_rate);
+		}
+		if (t >= next_key) {
+			byte = pending ? scan[pending & -pending] : SCAN_OTHER;
+			pending &= pending - 1;
+			t0 = now_ns();
+			if (write(inject_fd, &byte, 1) == 1) {
+				samples_add(&inject, now_ns() - t0);
+				keys++;
+			}
+			next_key += (uint64_t)(1e9 / rate);
+		}
+
+		/* then read events until the next injection is due */
+		t = now_ns();
+		t0 = next_key < next_tick ? next_key : next_tick;
+		timeout = t0 > t ? (int)((t0 - t) / 1000000) : 0;
+		pfd.fd = events_fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, timeout) <= 0)
+			continue;
+		n = read(events_fd, evs, sizeof(evs));
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			perror("read " EVENTS_PATH);
+			return 1;
+		}
+		t = now_ns();
+		for (i = 0; i < n / (ssize_t)sizeof(evs[0]); i++) {
+			struct keydance_event *ev = &evs[i];
+
+			events++;
+			if (seq_valid && ev->seq != seq + 1)
+				lost += ev->seq - seq - 1;
+			seq = ev->seq;
+			seq_valid = 1;
+			samples_add(&delivery, t - ev->time_ns);
+			if (ev->session)
+				continue;
+			switch (ev->type) {
+			case KEYDANCE_EV_PATTERN:
+				pending = ev->pattern;
+				pattern_ns = ev->time_ns;
+				break;
+			case KEYDANCE_EV_KEY:
+				if (pattern_ns && ev->time_ns >= pattern_ns)
+					samples_add(&reaction,
+						    ev->time_ns - pattern_ns);
+				break;
+			case KEYDANCE_EV_GAME_OVER:
+				pending = 0;
+				pattern_ns = 0;
+				byte = KEYDANCE_SIM_START;
+				if (write(inject_fd, &byte, 1) == 1)
+					games++;
+				break;
+			}
+		}
+	}
+	seconds = (now_ns() - start) / 1e9;
+	stats_copy(page, &after);
+	if (have_save)
+		have_save = !save_read(sv1);
+
+	if (!quiet)
+		printf("%.1f s, %.0f keys/s and %.0f ticks/s asked\n", seconds,
+		       rate, tick_rate);
+	printf("keys/s           %10.0f\n", keys / seconds);
+	printf("ticks/s          %10.0f\n", ticks / seconds);
+	printf("events/s         %10.0f\n", events / seconds);
+	printf("events lost      %10lu\n", lost);
+	printf("games            %10lu\n", games);
+	printf("interrupts       %10llu\n", (unsigned long long)
+	       (after.total_interrupts - before.total_interrupts));
+	printf("filtered         %10llu\n", (unsigned long long)
+	       (after.total_filtered - before.total_filtered));
+	printf("dance keys       %10llu\n", (unsigned long long)
+	       (after.total_keys - before.total_keys));
+	printf("hits             %10llu\n", (unsigned long long)
+	       (after.total_hits - before.total_hits));
+	printf("misses           %10llu\n", (unsigned long long)
+	       (after.total_misses - before.total_misses));
+	printf("LED writes       %10llu (of %llu updates)\n",
+	       (unsigned long long)(after.led_writes - before.led_writes),
+	       (unsigned long long)(after.led_posts - before.led_posts));
+
+	printf("\n%-16s %10s %10s %10s %10s %10s\n", "latency (us)", "count",
+	       "p50", "p90", "p99", "max");
+	report_samples("inject", &inject);
+	report_samples("event delivery", &delivery);
+	report_samples("reaction", &reaction);
+	if (have_save) {
+		for (i = 0; i < KEYDANCE_SAVE_BUCKETS; i++)
+			led_total += sv1->hists[HIST_LED].count[i] -
+				     sv0->hists[HIST_LED].count[i];
+		printf("%-16s %10llu %10llu %10llu %10llu %10llu\n",
+		       "LED update", (unsigned long long)led_total,
+		       (unsigned long long)hist_pct(&sv0->hists[HIST_LED],
+				&sv1->hists[HIST_LED], led_total, 50),
+		       (unsigned long long)hist_pct(&sv0->hists[HIST_LED],
+				&sv1->hists[HIST_LED], led_total, 90),
+		       (unsigned long long)hist_pct(&sv0->hists[HIST_LED],
+				&sv1->hists[HIST_LED], led_total, 99),
+		       (unsigned long long)(sv1->hists[HIST_LED].max_ns / 1000));
+	}
+	return 0;
+}